@@ -0,0 +1,197 @@
+/*  list_bench.c
+ *   Times LIST and NLST of a big directory through ftp_server.
+ *
+ *   list_bench <ftp_server binary> [entries]
+ *
+ *   Fills a scratch directory with entries files (20000 by default), starts
+ *   the server on a free loopback port and lists the directory: uncached,
+ *   with a file created and removed before each round so the listing cache
+ *   drops it, then from the cache. The best of a few rounds is printed in
+ *   entries/s. The directory is removed at the end.
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_ENTRIES 20000
+#define ROUNDS 5
+#define SETTLE_US 200000 // for the server to see the directory change
+
+static char reply[1024];
+
+static double seconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int connect_to(int port) {
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+                             .sin_port = htons(port)};
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+  if (sock >= 0 && connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+// A port nobody listens on right now
+static int free_port() {
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  socklen_t len = sizeof(addr);
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+  bind(sock, (struct sockaddr *)&addr, sizeof(addr));
+  getsockname(sock, (struct sockaddr *)&addr, &len);
+  close(sock);
+  return ntohs(addr.sin_port);
+}
+
+// Reads one reply, the last line of a multi-line one, returns its code
+static int read_reply(FILE *control) {
+  do {
+    if (fgets(reply, sizeof(reply), control) == NULL)
+      return -1;
+  } while (strlen(reply) < 4 || reply[3] == '-');
+  return atoi(reply);
+}
+
+// The replies are read through control, the commands written to its fd
+// in one piece (Nagle would hold a separate CRLF back)
+static int command(FILE *control, const char *format, const char *arg) {
+  char line[4096];
+  int len = snprintf(line, sizeof(line) - 2, format, arg);
+
+  if (len < 0 || len >= (int)sizeof(line) - 2)
+    return -1;
+  memcpy(line + len, "\r\n", 2);
+  if (write(fileno(control), line, len + 2) != len + 2)
+    return -1;
+  return read_reply(control);
+}
+
+// Lines of the listing, -1 on error. *elapsed is from the command to the
+// end of the data: the 226 after it can wait for the client's delayed ACK
+// of the 150 (Nagle), which isn't the listing's cost.
+static long list(FILE *control, const char *verb, double *elapsed) {
+  int a, b, c, d, p1, p2;
+  char buffer[65536];
+  long lines = 0;
+  ssize_t got;
+
+  if (command(control, "PASV", NULL) != 227 ||
+      sscanf(strchr(reply, '('), "(%d,%d,%d,%d,%d,%d)", &a, &b, &c, &d, &p1,
+             &p2) != 6)
+    return -1;
+  int data = connect_to(p1 * 256 + p2);
+  double start = seconds();
+  if (data < 0 || command(control, "%s", verb) != 150)
+    return -1;
+  while ((got = read(data, buffer, sizeof(buffer))) > 0)
+    for (ssize_t i = 0; i < got; i++)
+      lines += buffer[i] == '\n';
+  *elapsed = seconds() - start;
+  close(data);
+  return read_reply(control) == 226 ? lines : -1;
+}
+
+static void bench(FILE *control, const char *dir, const char *verb,
+                  bool cached) {
+  double best = 0, elapsed;
+  long lines = 0;
+  char name[4096];
+
+  snprintf(name, sizeof(name), "%s/.list_bench", dir);
+  list(control, verb, &elapsed); // cached either way afterwards
+  for (int round = 0; round < ROUNDS; round++) {
+    if (!cached) {
+      close(open(name, O_CREAT | O_WRONLY, 0644));
+      unlink(name);
+      usleep(SETTLE_US);
+    }
+    lines = list(control, verb, &elapsed);
+    if (lines < 0) {
+      fprintf(stderr, "%s failed: %s", verb, reply);
+      return;
+    }
+    if (best == 0 || elapsed < best)
+      best = elapsed;
+  }
+  printf("%s %-8s %6ld entries %8.4fs %10.0f entries/s\n", verb,
+         cached ? "cached" : "uncached", lines, best, lines / best);
+}
+
+int main(int argc, char *argv[]) {
+  char dir[] = "/tmp/list_bench.XXXXXX", name[4096], port_arg[16];
+  int entries = argc > 2 ? atoi(argv[2]) : DEFAULT_ENTRIES;
+
+  if (argc < 2 || entries <= 0) {
+    fprintf(stderr, "usage: %s <ftp_server binary> [entries]\n", argv[0]);
+    return 1;
+  }
+  char *server = realpath(argv[1], NULL);
+  if (server == NULL || mkdtemp(dir) == NULL) {
+    perror(server == NULL ? argv[1] : "mkdtemp");
+    return 1;
+  }
+  for (int i = 0; i < entries; i++) {
+    snprintf(name, sizeof(name), "%s/file%06d.txt", dir, i);
+    close(open(name, O_CREAT | O_WRONLY, 0644));
+  }
+
+  int port = free_port();
+  snprintf(port_arg, sizeof(port_arg), "%d", port);
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    if (chdir(dir) == 0)
+      execl(server, server, port_arg, "127.0.0.1", NULL);
+    _exit(1);
+  }
+
+  int sock = -1;
+  for (int tries = 0; tries < 50 && sock < 0; tries++) {
+    usleep(100000);
+    sock = connect_to(port);
+  }
+  FILE *control = sock >= 0 ? fdopen(sock, "r") : NULL;
+  if (control == NULL || read_reply(control) != 220 ||
+      command(control, "USER %s", "anonymous") < 0 ||
+      command(control, "PASS %s", "bench@") != 230 ||
+      command(control, "CWD %s", dir) != 250) {
+    fprintf(stderr, "can't log in to %s: %s\n", server,
+            control != NULL ? reply : strerror(errno));
+  } else {
+    bench(control, dir, "LIST", false);
+    bench(control, dir, "LIST", true);
+    bench(control, dir, "NLST", false);
+    bench(control, dir, "NLST", true);
+    command(control, "QUIT", NULL);
+  }
+
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  for (int i = 0; i < entries; i++) {
+    snprintf(name, sizeof(name), "%s/file%06d.txt", dir, i);
+    unlink(name);
+  }
+  rmdir(dir);
+  free(server);
+  return 0;
+}
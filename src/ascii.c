@@ -0,0 +1,208 @@
+/*  ascii.c
+ *   LF <-> CRLF translation kernels, see ascii.h.
+ *
+ *   The vector kernels compare 64 bytes at a time against the line end
+ *   character and get a bit mask of the matches, then copy the runs between
+ *   the set bits with whole vector loads and stores. Only line ends cost a
+ *   branch, the memchr() + memcpy() pair of the scalar code costs two calls
+ *   per line.
+ */
+#include "ascii.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ASCII_X86
+#endif
+
+static size_t encode_scalar(const char *in, size_t len, char *out);
+static size_t decode_scalar(const char *in, size_t len, char *out,
+                            bool *pending_cr);
+
+static size_t (*encode_kernel)(const char *, size_t, char *) = encode_scalar;
+static size_t (*decode_kernel)(const char *, size_t, char *,
+                               bool *) = decode_scalar;
+
+size_t ascii_encode(const char *in, size_t len, char *out) {
+  return encode_kernel(in, len, out);
+}
+
+size_t ascii_decode(const char *in, size_t len, char *out, bool *pending_cr) {
+  if (len == 0)
+    return 0;
+
+  // a CR held back from the previous buffer is dropped before an LF
+  size_t extra = 0;
+  if (*pending_cr) {
+    *pending_cr = false;
+    if (in[0] != '\n') {
+      *out++ = '\r';
+      extra = 1;
+    }
+  }
+  return extra + decode_kernel(in, len, out, pending_cr);
+}
+
+static size_t encode_scalar(const char *in, size_t len, char *out) {
+  const char *end = in + len;
+  char *start = out;
+  const char *lf;
+
+  while ((lf = memchr(in, '\n', end - in)) != NULL) {
+    memcpy(out, in, lf - in);
+    out += lf - in;
+    *out++ = '\r';
+    *out++ = '\n';
+    in = lf + 1;
+  }
+  memcpy(out, in, end - in);
+  return out + (end - in) - start;
+}
+
+static size_t decode_scalar(const char *in, size_t len, char *out,
+                            bool *pending_cr) {
+  const char *end = in + len;
+  char *start = out;
+  const char *cr;
+
+  while ((cr = memchr(in, '\r', end - in)) != NULL) {
+    memcpy(out, in, cr - in);
+    out += cr - in;
+    in = cr + 1;
+    if (in == end)
+      *pending_cr = true;
+    else if (*in != '\n')
+      *out++ = '\r';
+  }
+  memcpy(out, in, end - in);
+  return out + (end - in) - start;
+}
+
+#ifdef ASCII_X86
+// Runs are copied a vector at a time, so the copy may store past the end
+// of a run (into the ASCII_SLACK the caller leaves) and load past it (so the
+// vector loop stops short of the end of the input, the scalar code does the
+// tail).
+
+__attribute__((target("sse2"))) static inline uint64_t
+mask_sse2(const char *in, char c) {
+  const __m128i match = _mm_set1_epi8(c);
+  uint64_t mask = 0;
+  for (int i = 0; i < 64; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(in + i));
+    uint16_t bits = _mm_movemask_epi8(_mm_cmpeq_epi8(block, match));
+    mask |= (uint64_t)bits << i;
+  }
+  return mask;
+}
+
+__attribute__((target("sse2"))) static inline void
+copy_sse2(char *out, const char *in, size_t len) {
+  for (size_t i = 0; i < len; i += 16)
+    _mm_storeu_si128((__m128i *)(out + i),
+                     _mm_loadu_si128((const __m128i *)(in + i)));
+}
+
+__attribute__((target("avx2"))) static inline uint64_t
+mask_avx2(const char *in, char c) {
+  const __m256i match = _mm256_set1_epi8(c);
+  __m256i low = _mm256_loadu_si256((const __m256i *)in);
+  __m256i high = _mm256_loadu_si256((const __m256i *)(in + 32));
+  return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(low, match)) |
+         (uint64_t)(uint32_t)_mm256_movemask_epi8(
+             _mm256_cmpeq_epi8(high, match))
+             << 32;
+}
+
+__attribute__((target("avx2"))) static inline void
+copy_avx2(char *out, const char *in, size_t len) {
+  for (size_t i = 0; i < len; i += 32)
+    _mm256_storeu_si256((__m256i *)(out + i),
+                        _mm256_loadu_si256((const __m256i *)(in + i)));
+}
+
+#define ASCII_KERNELS(isa)                                                     \
+  __attribute__((target(#isa))) static size_t encode_##isa(                    \
+      const char *in, size_t len, char *out) {                                 \
+    char *start = out;                                                         \
+    size_t i, done = 0;                                                        \
+    for (i = 0; i + 64 + ASCII_SLACK <= len; i += 64) {                        \
+      for (uint64_t mask = mask_##isa(in + i, '\n'); mask != 0;                \
+           mask &= mask - 1) {                                                 \
+        size_t lf = i + __builtin_ctzll(mask);                                 \
+        copy_##isa(out, in + done, lf - done);                                 \
+        out += lf - done;                                                      \
+        *out++ = '\r';                                                         \
+        *out++ = '\n';                                                         \
+        done = lf + 1;                                                         \
+      }                                                                        \
+    }                                                                          \
+    copy_##isa(out, in + done, i - done);                                      \
+    out += i - done;                                                           \
+    return out - start + encode_scalar(in + i, len - i, out);                  \
+  }                                                                            \
+                                                                               \
+  __attribute__((target(#isa))) static size_t decode_##isa(                    \
+      const char *in, size_t len, char *out, bool *pending_cr) {               \
+    char *start = out;                                                         \
+    size_t i, done = 0;                                                        \
+    for (i = 0; i + 64 + ASCII_SLACK <= len; i += 64) {                        \
+      for (uint64_t mask = mask_##isa(in + i, '\r'); mask != 0;                \
+           mask &= mask - 1) {                                                 \
+        size_t cr = i + __builtin_ctzll(mask);                                 \
+        if (in[cr + 1] != '\n')                                                \
+          continue;                                                            \
+        copy_##isa(out, in + done, cr - done);                                 \
+        out += cr - done;                                                      \
+        done = cr + 1;                                                         \
+      }                                                                        \
+    }                                                                          \
+    copy_##isa(out, in + done, i - done);                                      \
+    out += i - done;                                                           \
+    return out - start + decode_scalar(in + i, len - i, out, pending_cr);      \
+  }
+
+ASCII_KERNELS(sse2)
+ASCII_KERNELS(avx2)
+#endif
+
+const char *ascii_init() {
+#ifdef ASCII_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    encode_kernel = encode_avx2;
+    decode_kernel = decode_avx2;
+    return "avx2";
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    encode_kernel = encode_sse2;
+    decode_kernel = decode_sse2;
+    return "sse2";
+  }
+#endif
+  return "scalar";
+}
+
+bool ascii_use(const char *name) {
+  if (strcmp(name, "scalar") == 0) {
+    encode_kernel = encode_scalar;
+    decode_kernel = decode_scalar;
+    return true;
+  }
+#ifdef ASCII_X86
+  __builtin_cpu_init();
+  if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+    encode_kernel = encode_avx2;
+    decode_kernel = decode_avx2;
+    return true;
+  }
+  if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+    encode_kernel = encode_sse2;
+    decode_kernel = decode_sse2;
+    return true;
+  }
+#endif
+  return false;
+}
@@ -0,0 +1,36 @@
+/*  ascii.h
+ *   Line ending translation for TYPE A transfers.
+ *
+ *   Files are sent with every LF turned into CRLF and uploads have their
+ *   CRLF pairs turned back into LF. Both directions scan for the line end
+ *   characters with SSE2, or AVX2 when the CPU has it, and copy the runs in
+ *   between whole, so the cost is per line rather than per byte. Other
+ *   architectures use a memchr() based loop.
+ */
+#ifndef ASCII_H
+#define ASCII_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Picks the kernels for this CPU, returns their name for the log
+const char *ascii_init();
+
+// Switches to the named kernels ("scalar", "sse2" or "avx2") for the
+// benchmark, false when this CPU doesn't have them
+bool ascii_use(const char *name);
+
+// Room the kernels may write past the end of their output
+#define ASCII_SLACK 64
+
+// LF -> CRLF, out needs room for 2 * len + ASCII_SLACK bytes. Returns the
+// bytes written.
+size_t ascii_encode(const char *in, size_t len, char *out);
+
+// CRLF -> LF, out needs room for len + 1 + ASCII_SLACK bytes and must not
+// overlap in. A CR ending the buffer is held back in *pending_cr until the
+// next call shows whether an LF follows, at the end of the stream a pending
+// CR is data.
+size_t ascii_decode(const char *in, size_t len, char *out, bool *pending_cr);
+
+#endif
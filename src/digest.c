@@ -0,0 +1,204 @@
+/*  digest.c
+ *   File checksums, see digest.h.
+ *
+ *   The PCLMULQDQ CRC-32 follows Intel's "Fast CRC Computation for Generic
+ *   Polynomials Using PCLMULQDQ Instruction": four 128 bit lanes are folded
+ *   over the data, then into one lane, then reduced to 32 bits with a
+ *   Barrett reduction. The constants are for the bit reflected polynomial
+ *   0x04C11DB7.
+ */
+#include "digest.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DIGEST_X86
+#endif
+
+#define DIGEST_CHUNK (256 * 1024)
+
+static const char *digest_names[DIGEST_TYPES] = {"SHA-256", "MD5", "CRC32"};
+
+static uint32_t crc32_zlib(uint32_t crc, const unsigned char *buffer,
+                           size_t len);
+
+static uint32_t (*crc32_kernel)(uint32_t, const unsigned char *,
+                                size_t) = crc32_zlib;
+
+const char *digest_name(DigestType type) { return digest_names[type]; }
+
+bool digest_parse(const char *name, DigestType *type) {
+  for (int i = 0; i < DIGEST_TYPES; i++) {
+    if (strcasecmp(name, digest_names[i]) == 0) {
+      *type = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+uint32_t digest_crc32(uint32_t crc, const unsigned char *buffer, size_t len) {
+  return crc32_kernel(crc, buffer, len);
+}
+
+static uint32_t crc32_zlib(uint32_t crc, const unsigned char *buffer,
+                           size_t len) {
+  return crc32(crc, buffer, len);
+}
+
+#ifdef DIGEST_X86
+// Folds len bytes, a multiple of 16 and at least 64, into crc (not
+// inverted, unlike the zlib interface)
+__attribute__((target("pclmul,sse4.1"))) static uint32_t
+crc32_fold(uint32_t crc, const unsigned char *buffer, size_t len) {
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+  const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+  const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+  __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_loadu_si128((const __m128i *)buffer);
+  x2 = _mm_loadu_si128((const __m128i *)(buffer + 16));
+  x3 = _mm_loadu_si128((const __m128i *)(buffer + 32));
+  x4 = _mm_loadu_si128((const __m128i *)(buffer + 48));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+  buffer += 64;
+  len -= 64;
+
+  // four lanes, 64 bytes per step
+  for (; len >= 64; buffer += 64, len -= 64) {
+    x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                       _mm_loadu_si128((const __m128i *)buffer));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                       _mm_loadu_si128((const __m128i *)(buffer + 16)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                       _mm_loadu_si128((const __m128i *)(buffer + 32)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                       _mm_loadu_si128((const __m128i *)(buffer + 48)));
+  }
+
+  // the four lanes into one, then the remaining 16 byte blocks
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+  for (; len >= 16; buffer += 16, len -= 16) {
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                       _mm_loadu_si128((const __m128i *)buffer));
+  }
+
+  // 128 -> 64 bits
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, low32);
+  x1 = _mm_clmulepi64_si128(x1, k5, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits
+  x2 = _mm_and_si128(x1, low32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+  x2 = _mm_and_si128(x2, low32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const unsigned char *buffer,
+                             size_t len) {
+  if (len >= 64) {
+    size_t folded = len & ~(size_t)15;
+    crc = ~crc32_fold(~crc, buffer, folded);
+    buffer += folded;
+    len -= folded;
+  }
+  return crc32_zlib(crc, buffer, len);
+}
+#endif
+
+const char *digest_init() {
+#ifdef DIGEST_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+    crc32_kernel = crc32_pclmul;
+    return "pclmul";
+  }
+#endif
+  return "zlib";
+}
+
+bool digest_file(DigestType type, int file_fd, off_t offset, off_t end,
+                 char *hex) {
+  static __thread unsigned char *buffer = NULL;
+  EVP_MD_CTX *context = NULL;
+  uint32_t crc = 0;
+  bool ok = true;
+
+  if (buffer == NULL && (buffer = malloc(DIGEST_CHUNK)) == NULL)
+    return false;
+  if (type != DIGEST_CRC32) {
+    context = EVP_MD_CTX_new();
+    if (context == NULL ||
+        !EVP_DigestInit_ex(context,
+                           type == DIGEST_MD5 ? EVP_md5() : EVP_sha256(),
+                           NULL)) {
+      EVP_MD_CTX_free(context);
+      return false;
+    }
+  }
+
+  posix_fadvise(file_fd, offset, end == -1 ? 0 : end - offset,
+                POSIX_FADV_SEQUENTIAL);
+  while (end == -1 || offset < end) {
+    size_t len = end != -1 && end - offset < DIGEST_CHUNK ? end - offset
+                                                           : DIGEST_CHUNK;
+    ssize_t got = pread(file_fd, buffer, len, offset);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0) {
+      ok = got == 0;
+      break;
+    }
+    if (context != NULL)
+      EVP_DigestUpdate(context, buffer, got);
+    else
+      crc = digest_crc32(crc, buffer, got);
+    offset += got;
+  }
+
+  if (context == NULL) {
+    snprintf(hex, DIGEST_HEX_SIZE, "%08x", crc);
+  } else {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len = 0;
+    ok = EVP_DigestFinal_ex(context, digest, &digest_len) && ok;
+    for (unsigned int i = 0; i < digest_len; i++)
+      snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+    EVP_MD_CTX_free(context);
+  }
+  return ok;
+}
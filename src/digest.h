@@ -0,0 +1,44 @@
+/*  digest.h
+ *   File checksums for XCRC, XMD5 and HASH.
+ *
+ *   CRC-32 (the zip/ethernet one) folds 64 bytes per step with carry-less
+ *   multiplication (PCLMULQDQ) when the CPU has it and falls back to zlib.
+ *   MD5 and SHA-256 come from OpenSSL, which uses the SHA extensions or
+ *   AVX2 on its own where available.
+ */
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Lowercase hex of the longest digest plus the terminating NUL
+#define DIGEST_HEX_SIZE 65
+
+typedef enum {
+  DIGEST_SHA256, // first, the default of a new session
+  DIGEST_MD5,
+  DIGEST_CRC32,
+  DIGEST_TYPES
+} DigestType;
+
+// Picks the CRC-32 kernel for this CPU, returns its name for the log
+const char *digest_init();
+
+// Name as used by the HASH command, e.g. "SHA-256"
+const char *digest_name(DigestType type);
+
+// Case insensitive, false for unknown names
+bool digest_parse(const char *name, DigestType *type);
+
+// zlib compatible crc32() update
+uint32_t digest_crc32(uint32_t crc, const unsigned char *buffer, size_t len);
+
+// Digest of the bytes of file_fd from offset up to end (-1 for the end of
+// the file) as lowercase hex. False on read errors.
+bool digest_file(DigestType type, int file_fd, off_t offset, off_t end,
+                 char *hex);
+
+#endif
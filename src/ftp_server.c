@@ -2,11 +2,38 @@
  *   2024 by romheat@gmail.com
  *   A simple FTP server that supports passive mode only.
  *
- *   Usage: ./ftp_server [port] [server_ip]
+ *   Usage: ./ftp_server [port] [server_ip] [pasv_min-pasv_max]
  *
  *   If no port is provided, the server will listen on port 21.
+ *   If no passive port range is provided, ports 50000-50099 are used.
  *   If no server IP is provided, the server will listen on the local IP
- * address. The server will only accept one connection at a time.
+ * address. Clients are served concurrently: an epoll event loop owns the
+ * control sockets and hands complete commands to a bounded pool of worker
+ * threads that run the (blocking) transfers.
+ *
+ *   RETR of <dir>.tar or <dir>.zip, when no such file exists, streams an
+ * archive of the whole directory tree generated on the fly.
+ *
+ *   MODE Z compresses the data connections of a session with deflate (zlib
+ * format, as other servers and clients do), MODE S turns it back off.
+ *
+ *   TYPE A translates line endings of files, LF on disk and CRLF on the
+ * wire, TYPE I sends them as they are.
+ *
+ *   FTP_ENGINE=io_uring in the environment replaces epoll with io_uring:
+ * accepts and control channel reads go through one ring and the workers
+ * get rings of their own for uploads and read-ahead, falling back to the
+ * plain system calls when the kernel refuses io_uring.
+ *
+ *   FTP_SHARDS=n runs n event loops, each pinned to a CPU and accepting on
+ * its own SO_REUSEPORT listener, FTP_BACKLOG sets the listen backlog (see
+ * shard.h). Commands of every shard run on the same worker pool.
+ *
+ *   Sessions idle for FTP_IDLE_TIMEOUT seconds are closed, a passive data
+ * connection not made within FTP_ACCEPT_TIMEOUT fails the transfer and so
+ * does a transfer that moves no data for FTP_STALL_TIMEOUT (see timer.h).
+ * FTP_RATE, FTP_IP_RATE and FTP_SESSION_RATE cap the bandwidth of the
+ * data connections (see ratelimit.h).
  *
  *   Supported commands:
  *   - USER
@@ -14,48 +41,370 @@
  *   - PWD
  *   - CWD
  *   - TYPE
+ *   - MODE
  *   - PASV
  *   - NLST
  *   - LIST
  *   - RETR
+ *   - MGET
  *   - STOR
+ *   - APPE
+ *   - ALLO
+ *   - REST
+ *   - SIZE
+ *   - MDTM
+ *   - FEAT
+ *   - XCRC
+ *   - XMD5
+ *   - HASH
+ *   - RANG
+ *   - OPTS
  *   - QUIT
  */
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <glob.h>
 #include <grp.h>
 #include <ifaddrs.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <poll.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
+
+#include "ascii.h"
+#include "digest.h"
+#include "log.h"
+#include "ratelimit.h"
+#include "shard.h"
+#include "timer.h"
+#include "uring.h"
 
 #define PORT 21
 #define BUFFER_SIZE 1024
-#define MAX_CLIENTS 5
 #define MAX_PATH 512
 #define DEFAULT_PORT 21
-
-typedef struct {
+#define PASV_PORT_MIN 50000
+#define PASV_PORT_MAX 50099
+#define WORKER_THREADS 8
+#define MAX_EVENTS 64
+#define SENDFILE_CHUNK (1 << 30)
+#define PIPE_CHUNK (64 * 1024)
+#define RECV_CHUNK (256 * 1024)
+#define LIST_CHUNK (16 * 1024)
+#define LIST_IOV 8
+#define NAME_CACHE_SIZE 256
+#define STAT_CACHE_SIZE 256
+#define STAT_CACHE_TTL 2 // seconds
+#define DIGEST_CACHE_SIZE 256
+#define COMMAND_TABLE_BITS 6
+#define COMMAND_TABLE_SIZE (1 << COMMAND_TABLE_BITS)
+#define LIST_CACHE_ENTRIES 64
+#define LIST_CACHE_MAX (4 * 1024 * 1024)
+#define FILE_CACHE_MAX_FILE (256 * 1024)
+#define FILE_CACHE_SIZE (32 * 1024 * 1024)
+#define TAR_BLOCK 512
+#define ZIP_MAX_ENTRIES 0xffff // no Zip64, see zip_fits()
+#define CONTROL_RING_ENTRIES 256
+#define WORKER_RING_ENTRIES 16
+#define WORKER_RING_BUFFERS 4 // of RECV_CHUNK bytes
+#define URING_RECV_TAG 0x100  // user_data of upload recvs, buffer index below
+#define URING_ACCEPT_TAG 0x200 // user_data of data connection accepts
+#define IDLE_TIMEOUT 300      // seconds
+#define ACCEPT_TIMEOUT 30
+#define STALL_TIMEOUT 60
+
+// A session is IDLE while its control socket is armed in epoll and BUSY
+// while a worker thread is running one of its commands.
+typedef enum { SESSION_IDLE, SESSION_BUSY } SessionState;
+
+typedef struct ClientConnection {
+  unsigned long id;
   int control_socket;
-  int data_socket;
+  int data_socket; // passive listener, -1 until PASV
+  bool data_pooled;
   struct in_addr client_addr;
+  char client_ip[INET_ADDRSTRLEN];
   char current_dir[MAX_PATH - 1];
+  SessionState state;
+  struct Shard *shard; // whose event loop watches the control socket
+  Timer idle_timer;
+  long long last_active; // timer_now() at the end of the last command
+  Timer data_timer;      // data accept timeout, then transfer stall
+  bool accept_timed_out; // the passive listener was shut down
+  bool transfer_stalled; // the data connection was shut down
+  int transfer_socket;
+  unsigned long long transfer_progress; // bytes moved at the last check
+  RateLimit rate;
+  off_t alloc_size;     // announced by ALLO for the next STOR
+  off_t restart_offset; // set by REST for the next RETR/STOR
+  bool mode_z;          // data connections are deflated
+  bool type_ascii;      // TYPE A, files are sent and stored as CRLF text
+  DigestType hash_type; // algorithm of HASH, chosen with OPTS HASH
+  bool range_set;       // RANG given for the next HASH
+  off_t range_start;
+  off_t range_end; // exclusive
+  char buffer[BUFFER_SIZE]; // control channel input, at most a partial line
+  size_t buffered;          // when the session is idle
+  bool skip_line;           // discarding the rest of an overlong line
+  bool logged_in;
+  struct ClientConnection *next; // work queue link
 } ClientConnection;
 
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  ClientConnection *head;
+  ClientConnection *tail;
+} WorkQueue;
+
+// The kernel's struct tcp_info goes on past the end of glibc's, up to the
+// byte counters (Linux 4.1)
+typedef struct {
+  struct tcp_info base;
+  uint64_t pacing_rate;
+  uint64_t max_pacing_rate;
+  uint64_t bytes_acked;
+  uint64_t bytes_received;
+} TcpInfo;
+
+// What a data connection carries, for filter_begin()
+typedef enum { FILTER_DOWNLOAD, FILTER_UPLOAD, FILTER_LISTING } FilterKind;
+
+// Encoding of one transfer's payload for sessions that aren't in plain
+// binary stream mode, see filter_begin(). Senders use it instead of the
+// zero-copy paths, NULL stands for no encoding.
+typedef struct {
+  int socket;
+  bool upload;  // decoding what is received instead of encoding
+  bool deflate; // MODE Z
+  bool ascii;   // TYPE A
+  bool pending_cr;
+  z_stream stream;
+  unsigned char in[PIPE_CHUNK];
+  unsigned char out[PIPE_CHUNK];
+  char text[2 * PIPE_CHUNK + ASCII_SLACK]; // line ending translation
+} DataFilter;
+
+// Listing output is formatted into LIST_IOV chunks that go out with a single
+// writev() once they are all full.
+typedef struct {
+  int socket;
+  DataFilter *filter; // MODE Z, instead of writev()
+  int count;
+  size_t used;
+  struct iovec iov[LIST_IOV];
+  char chunks[LIST_IOV][LIST_CHUNK];
+  char *capture; // copy of everything sent, for the listing cache
+  size_t capture_len;
+  size_t capture_size;
+} ListWriter;
+
+// A rendered LIST or NLST payload. Entries dropped from the cache while a
+// worker is still sending them are freed by the last release.
+typedef struct ListingEntry {
+  char path[MAX_PATH];
+  bool extended;
+  int wd;
+  int refs;
+  bool stale;
+  char *data;
+  size_t len;
+  struct ListingEntry *next;
+} ListingEntry;
+
+// LIST and NLST of a directory and the listings being rendered share its
+// watch, the last one to let go removes it
+typedef struct ListingWatch {
+  int wd;
+  int refs;
+  struct ListingWatch *next;
+} ListingWatch;
+
+// Server wide listing cache, most recently used first. Every cached
+// directory has an inotify watch and any change in it drops its entries.
+typedef struct {
+  pthread_mutex_t lock;
+  int inotify_fd;
+  unsigned long epoch; // bumped on every invalidation
+  int count;
+  ListingEntry *head;
+  ListingWatch *watches;
+} ListingCache;
+
+// Contents of a small file, valid while the file keeps the same size and
+// mtime. Like listings, entries are freed by the last sender.
+typedef struct FileEntry {
+  char path[MAX_PATH];
+  struct timespec mtime;
+  off_t size;
+  int refs;
+  bool stale;
+  char *data;
+  struct FileEntry *next;
+} FileEntry;
+
+// LRU cache of hot small files served by RETR, most recently used first
+typedef struct {
+  pthread_mutex_t lock;
+  size_t bytes;
+  unsigned long hits;
+  unsigned long misses;
+  FileEntry *head;
+} FileCache;
+
+// stat() results for SIZE and MDTM, direct mapped by path hash. Clients
+// tend to ask for the size and time of a file right before fetching it.
+typedef struct {
+  char path[MAX_PATH];
+  time_t loaded;
+  struct stat file_stat;
+} StatCacheEntry;
+
+typedef struct {
+  pthread_mutex_t lock;
+  StatCacheEntry entries[STAT_CACHE_SIZE];
+} StatCache;
+
+// Checksums of file ranges, direct mapped like the stat cache and valid
+// while the file keeps the same size and mtime.
+typedef struct {
+  char path[MAX_PATH];
+  DigestType type;
+  off_t start;
+  off_t end;
+  off_t size;
+  struct timespec mtime;
+  char hex[DIGEST_HEX_SIZE];
+} DigestCacheEntry;
+
+typedef struct {
+  pthread_mutex_t lock;
+  unsigned long hits;
+  unsigned long misses;
+  DigestCacheEntry entries[DIGEST_CACHE_SIZE];
+} DigestCache;
+
+// GNU tar header, one TAR_BLOCK
+typedef struct {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char checksum[8];
+  char type;
+  char linkname[100];
+  char magic[8];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+} TarHeader;
+
+// A member of a zip archive, kept for the central directory at the end
+typedef struct {
+  char *name;
+  uint16_t method;
+  uint16_t dos_time;
+  uint16_t dos_date;
+  uint32_t crc;
+  uint32_t compressed_size;
+  uint32_t size;
+  uint32_t offset;
+  mode_t mode;
+} ZipEntry;
+
+// Archive being streamed to a data connection, see send_archive()
+typedef struct {
+  int socket;
+  DataFilter *filter;
+  bool zip;
+  off_t written;
+  char name[MAX_PATH]; // path of the current member inside the archive
+  unsigned char *buffer; // zip: PIPE_CHUNK of input, PIPE_CHUNK of output
+  z_stream stream;
+  ZipEntry *entries;
+  size_t count; // members written
+  size_t capacity;
+} ArchiveWriter;
+
+// Listening sockets bound to the passive port range, handed out by PASV and
+// given back once the transfer is done.
+typedef struct {
+  pthread_mutex_t lock;
+  int *sockets;
+  int count;
+} PortPool;
+
+// The io_uring engine's ring in place of epoll. The event loop reaps it,
+// workers queue the next read of their session when done with it.
+typedef struct {
+  pthread_mutex_t lock; // submission side
+  Uring ring;
+  unsigned queued; // by the event loop, submitted with its next wait
+} ControlRing;
+
+// A listener and the event loop accepting on it, with the io_uring engine
+// the loop's ring
+typedef struct Shard {
+  int id;
+  int server_socket;
+  int epoll_fd;
+  ControlRing control;
+} Shard;
+
+// uid/gid -> name, direct mapped and shared by every session
+typedef struct {
+  bool valid;
+  unsigned int id;
+  char name[32];
+} NameCacheEntry;
+
+typedef struct {
+  pthread_mutex_t lock;
+  NameCacheEntry users[NAME_CACHE_SIZE];
+  NameCacheEntry groups[NAME_CACHE_SIZE];
+} NameCache;
+
+// What a command needs before its handler is run
+#define CMD_LOGIN 0x1 // USER/PASS done
+#define CMD_PASV 0x2  // a passive listener, the command opens a data channel
+#define CMD_ARG 0x4   // an argument
+
 typedef struct {
   const char *command;
   bool (*handler)(ClientConnection *conn, const char *arg);
+  int flags;
+  uint32_t key;                  // packed uppercase name, see command_key()
+  unsigned long calls;           // updated atomically by the workers
+  unsigned long long nanoseconds;
 } FtpCommand;
 
 bool cmd_user(ClientConnection *conn, const char *arg);
@@ -67,20 +416,83 @@ bool cmd_pasv(ClientConnection *conn, const char *arg);
 bool cmd_nlst(ClientConnection *conn, const char *arg);
 bool cmd_dir(ClientConnection *conn, const char *arg);
 bool cmd_retr(ClientConnection *conn, const char *arg);
+bool cmd_mretr(ClientConnection *conn, const char *arg);
 bool cmd_stor(ClientConnection *conn, const char *arg);
 bool cmd_quit(ClientConnection *conn, const char *arg);
+bool cmd_allo(ClientConnection *conn, const char *arg);
+bool cmd_appe(ClientConnection *conn, const char *arg);
+bool cmd_rest(ClientConnection *conn, const char *arg);
+bool cmd_size(ClientConnection *conn, const char *arg);
+bool cmd_mdtm(ClientConnection *conn, const char *arg);
+bool cmd_feat(ClientConnection *conn, const char *arg);
+bool cmd_mode(ClientConnection *conn, const char *arg);
+bool cmd_xcrc(ClientConnection *conn, const char *arg);
+bool cmd_xmd5(ClientConnection *conn, const char *arg);
+bool cmd_hash(ClientConnection *conn, const char *arg);
+bool cmd_rang(ClientConnection *conn, const char *arg);
+bool cmd_opts(ClientConnection *conn, const char *arg);
 
 FtpCommand ftp_commands[] = {
-    {"USER", cmd_user}, {"PASS", cmd_pass}, {"PWD", cmd_pwd},
-    {"CWD", cmd_cwd},   {"TYPE", cmd_type}, {"PASV", cmd_pasv},
-    {"NLST", cmd_nlst}, {"RETR", cmd_retr}, {"STOR", cmd_stor},
-    {"QUIT", cmd_quit}, {"LIST", cmd_dir},  {NULL, NULL}};
+    {"USER", cmd_user, 0},
+    {"PASS", cmd_pass, 0},
+    {"QUIT", cmd_quit, 0},
+    {"FEAT", cmd_feat, 0},
+    {"OPTS", cmd_opts, CMD_ARG},
+    {"PWD", cmd_pwd, CMD_LOGIN},
+    {"CWD", cmd_cwd, CMD_LOGIN | CMD_ARG},
+    {"TYPE", cmd_type, CMD_LOGIN | CMD_ARG},
+    {"MODE", cmd_mode, CMD_LOGIN | CMD_ARG},
+    {"PASV", cmd_pasv, CMD_LOGIN},
+    {"ALLO", cmd_allo, CMD_LOGIN | CMD_ARG},
+    {"REST", cmd_rest, CMD_LOGIN | CMD_ARG},
+    {"SIZE", cmd_size, CMD_LOGIN | CMD_ARG},
+    {"MDTM", cmd_mdtm, CMD_LOGIN | CMD_ARG},
+    {"XCRC", cmd_xcrc, CMD_LOGIN | CMD_ARG},
+    {"XMD5", cmd_xmd5, CMD_LOGIN | CMD_ARG},
+    {"HASH", cmd_hash, CMD_LOGIN | CMD_ARG},
+    {"RANG", cmd_rang, CMD_LOGIN | CMD_ARG},
+    {"NLST", cmd_nlst, CMD_LOGIN | CMD_PASV},
+    {"LIST", cmd_dir, CMD_LOGIN | CMD_PASV},
+    {"RETR", cmd_retr, CMD_LOGIN | CMD_PASV | CMD_ARG},
+    {"MGET", cmd_mretr, CMD_LOGIN | CMD_PASV | CMD_ARG},
+    {"STOR", cmd_stor, CMD_LOGIN | CMD_PASV | CMD_ARG},
+    {"APPE", cmd_appe, CMD_LOGIN | CMD_PASV | CMD_ARG},
+    {NULL, NULL, 0}};
+
+// ftp_commands hashed by key, open addressing with linear probing
+FtpCommand *command_table[COMMAND_TABLE_SIZE];
 
 char server_ip[16] = "";
 int server_port = DEFAULT_PORT;
+char root_dir[MAX_PATH] = "";
+
+Shard *shards = NULL;
+int shard_total = 1;
+bool uring_engine = false; // FTP_ENGINE=io_uring
+__thread bool event_loop_thread = false;
+// Session whose capped transfer the worker is running, NULL for none
+__thread ClientConnection *throttled = NULL;
+// The worker's io_uring, failed once it couldn't be set up or drained
+__thread Uring *worker_uring = NULL;
+__thread bool worker_uring_failed = false;
+int idle_timeout = IDLE_TIMEOUT; // seconds, 0 for none
+int accept_timeout = ACCEPT_TIMEOUT;
+int stall_timeout = STALL_TIMEOUT;
+unsigned long last_session_id = 0;
+unsigned long long deflate_in = 0, deflate_out = 0; // MODE Z totals
+WorkQueue work_queue = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                        NULL, NULL};
+NameCache name_cache = {PTHREAD_MUTEX_INITIALIZER};
+ListingCache listing_cache = {PTHREAD_MUTEX_INITIALIZER, -1};
+FileCache file_cache = {PTHREAD_MUTEX_INITIALIZER};
+PortPool port_pool = {PTHREAD_MUTEX_INITIALIZER};
+StatCache stat_cache = {PTHREAD_MUTEX_INITIALIZER};
+DigestCache digest_cache = {PTHREAD_MUTEX_INITIALIZER};
+int pasv_port_min = PASV_PORT_MIN;
+int pasv_port_max = PASV_PORT_MAX;
 
 #define MSG_RUNNING "FTP server listening on port %d\n"
-#define MSG_NEW_CLIENT "New client connected from %s\n"
+#define MSG_NEW_CLIENT "New client connected from %s"
 #define MSG_WELCOME                                                            \
   "220 Welcome to romheat mini FTP Server (Passive Mode Only)\r\n"
 #define MSG_USER_OK "331 User name okay, need password\r\n"
@@ -88,25 +500,51 @@ int server_port = DEFAULT_PORT;
 #define MSG_PWD "257 \"%s\" is the current directory\r\n"
 #define MSG_CWD_OK "250 Directory successfully changed\r\n"
 #define MSG_CWD_FAIL "550 Failed to change directory\r\n"
-#define MSG_TYPE_OK "200 Type set to I\r\n"
+#define MSG_TYPE_OK "200 Type set to %c\r\n"
+#define MSG_TYPE_FAIL "504 Unsupported type\r\n"
+#define MSG_MODE_OK "200 Mode set to %c\r\n"
+#define MSG_MODE_FAIL "504 Unsupported mode\r\n"
 #define MSG_ENTER_PASV "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d)\r\n"
 #define MSG_LIST_START                                                         \
   "150 Opening ASCII mode data connection for file list\r\n"
 #define MSG_LIST_END "226 Transfer complete\r\n"
-#define MSG_RETR_START "150 Opening BINARY mode data connection\r\n"
+#define MSG_RETR_START "150 Opening %s mode data connection\r\n"
 #define MSG_RETR_END "226 Transfer complete\r\n"
-#define MSG_STOR_START "150 Opening BINARY mode data connection\r\n"
+#define MSG_STOR_START "150 Opening %s mode data connection\r\n"
 #define MSG_STOR_END "226 Transfer complete\r\n"
+#define MSG_ALLO_OK "200 ALLO command successful\r\n"
+#define MSG_REST_OK "350 Restarting at %lld\r\n"
+#define MSG_SIZE "213 %lld\r\n"
+#define MSG_MDTM "213 %s\r\n"
+#define MSG_FILE_FAIL "550 File not available\r\n"
+#define MSG_BATCH_START                                                        \
+  "150 Opening %s mode data connection for %s (%lld bytes)\r\n"
+#define MSG_BATCH_FILE_FAIL "550 %s: File not available\r\n"
+#define MSG_BATCH_END "250 Batch complete, %zu of %zu files sent\r\n"
+#define MSG_FEAT                                                               \
+  "211-Features:\r\n SIZE\r\n MDTM\r\n REST STREAM\r\n MGET\r\n MODE Z\r\n"   \
+  " XCRC\r\n XMD5\r\n HASH %s\r\n RANG STREAM\r\n211 End\r\n"
+#define MSG_CHECKSUM "250 %s\r\n"
+#define MSG_HASH "213 %s %lld-%lld %s %s\r\n"
+#define MSG_HASH_TYPE "200 %s\r\n"
+#define MSG_RANG_OK "350 Restarting at %lld. Ending at %lld.\r\n"
+#define MSG_RANG_RESET "350 Restarting at 0. Ending at EOF.\r\n"
 #define MSG_QUIT "221 Goodbye\r\n"
 #define MSG_SYNTAX_ERROR "500 Syntax error, command unrecognized\r\n"
 #define MSG_NOT_IMPLEMENTED "502 Command not implemented\r\n"
+#define MSG_ARG_ERROR "501 Syntax error in parameters or arguments\r\n"
+#define MSG_NOT_LOGGED "530 Please login with USER and PASS\r\n"
+#define MSG_USE_PASV "425 Use PASV first\r\n"
 #define MSG_DATA_CONN_FAIL "425 Can't open data connection\r\n"
+#define MSG_TRANSFER_FAIL "451 Transfer aborted\r\n"
 #define MSG_GOODBYE "221 Goodbye\r\n"
+#define MSG_IDLE_TIMEOUT "421 Idle timeout, closing control connection\r\n"
 
 #define ERR_GETCWD_FAIL "getcwd() error"
 #define ERR_ACCEPT_FAIL "Accept failed"
 #define ERR_SOCKET_FAIL "Socket creation failed"
 #define ERR_SETSOCKOPT_FAIL "setsockopt(SO_REUSEADDR) failed"
+#define ERR_REUSEPORT_FAIL "setsockopt(SO_REUSEPORT) failed"
 #define ERR_BIND_FAIL "Bind failed"
 #define ERR_LISTEN_FAIL "Listen failed"
 #define ERR_SOCKET_FAIL "Socket creation failed"
@@ -114,36 +552,176 @@ int server_port = DEFAULT_PORT;
 #define ERR_OPEN_DIR "Unable to open directory"
 #define ERR_OPEN_FILE "Unable to open file"
 #define ERR_CREATE_FILE "Unable to create file"
+#define ERR_WRITE_FILE "Unable to write file"
 #define ERR_PORT_FAIL "Invalid port number %d\n"
-#define ERR_RECV_FAIL "Error receiving data\n"
-#define ERR_CLIENT_DISCONNECT "Client disconnected\n"
-
-#define LOG_SERVER_INFO "Server running on %s port %d\n"
-#define LOG_CWD "Current working dir: %s\n"
-#define LOG_CLOSING "Closing connection from %s\n"
+#define ERR_PASV_RANGE_FAIL "Invalid passive port range %s\n"
+#define ERR_RECV_FAIL "Error receiving data"
+#define ERR_CLIENT_DISCONNECT "Client disconnected"
+#define ERR_EPOLL_FAIL "epoll failed"
+#define ERR_URING_FAIL "io_uring failed"
+#define ERR_THREAD_FAIL "pthread_create failed"
+#define ERR_ALLOC_FAIL "Out of memory"
+#define ERR_ZIP_LIMIT "Directory too large for a zip archive"
+#define ERR_ZLIB_FAIL "zlib error on %s"
+
+#define LOG_SERVER_INFO "Server running on %s port %d"
+#define LOG_CWD "Current working dir: %s"
+#define LOG_PORT_POOL "Passive ports %d-%d, %d listeners ready"
+#define LOG_ENGINE "Event engine: %s, %d shards, backlog %d"
+#define LOG_TIMEOUTS "Timeouts: idle %ds, data accept %ds, stall %ds"
+#define LOG_IDLE_TIMEOUT "Idle for %ds, closing"
+#define LOG_STALLED "No data moved for %ds, aborting the transfer"
+#define LOG_CLOSING "Closing connection from %s"
 #define LOG_RECEIVED "Received [%s]: %s"
-#define LOG_SENT "Sent: %s"
-
-int create_server_socket(int port);
-int create_data_socket();
-void handle_client(ClientConnection *conn);
+#define LOG_SENT "Sent: %.*s"
+#define LOG_RECEIVED_FILE "Received %s (%.1f KB/s)"
+#define LOG_LISTED "Listed %d entries (%.0f entries/s)"
+#define LOG_LIST_CACHED "Sending cached listing of %s"
+#define LOG_SENDING_FILE "Sending file %s"
+#define LOG_SENDING_ARCHIVE "Sending %s archive of %s"
+#define LOG_SENT_ARCHIVE "Sent archive of %s, %zu entries"
+#define LOG_DEFLATED "Deflated %s to %llu bytes, %.1f%% (%.1f%% overall)"
+#define LOG_INFLATED "Inflated %s from %llu bytes, %.1f%%"
+#define LOG_ASCII_KERNEL "TYPE A line endings translated with %s"
+#define LOG_DIGEST_KERNEL "CRC32 computed with %s"
+#define LOG_DIGEST "%s of %s: %s (%lu hits, %lu misses)"
+#define LOG_BATCH_SENT "Batch sent %zu of %zu files"
+#define LOG_RECEIVING_FILE "Receiving file %s"
+#define LOG_FILE_CACHE "File cache %s (%lu hits, %lu misses)"
+#define LOG_COMMAND_TIME "Done (%lu calls, %.3fms average)"
+
+int create_server_socket(int port, bool reuse_port, int backlog);
+bool shards_open(int port);
+void shards_run();
+void *shard_thread(void *arg);
+int create_data_socket(int port);
+void port_pool_init(int min_port, int max_port);
+int port_pool_acquire();
+void port_pool_release(int sock);
+int accept_data_connection(ClientConnection *conn);
+int accept_data_wait(ClientConnection *conn);
+bool close_data_connection(ClientConnection *conn, int sock);
+void release_data_socket(ClientConnection *conn);
+long session_idle_expired(Timer *timer);
+long data_accept_expired(Timer *timer);
+long transfer_stall_expired(Timer *timer);
+void event_loop(Shard *shard);
+void uring_event_loop(Shard *shard);
+bool control_ring_queue(ControlRing *control, int op, int fd, void *addr,
+                        unsigned len, void *user_data);
+Uring *worker_ring();
+void worker_ring_drain(Uring *ring);
+void *worker_thread(void *arg);
+void session_open(int control_socket, struct sockaddr_in *client_addr,
+                  Shard *shard);
+void session_arm(ClientConnection *conn, int op);
+void session_read(ClientConnection *conn);
+void session_received(ClientConnection *conn, ssize_t bytes_received);
+bool session_process(ClientConnection *conn);
+void session_close(ClientConnection *conn);
+void work_queue_push(ClientConnection *conn);
+ClientConnection *work_queue_pop();
 bool handle_command(ClientConnection *conn, char *buffer);
+uint32_t command_key(const char *command);
+unsigned int command_slot(uint32_t key);
+void build_command_table();
+FtpCommand *find_command(const char *command);
 void send_response(int socket, const char *format, ...);
-void list_directory(int socket, const char *path);
-void list_directory_extend(int socket, const char *path);
-void send_file(int socket, const char *filename);
-void receive_file(int socket, const char *filename);
+void send_listing(int socket, const char *path, bool extended,
+                  DataFilter *filter);
+bool list_directory(ListWriter *writer, const char *path);
+bool list_directory_extend(ListWriter *writer, const char *path);
+char *list_writer_reserve(ListWriter *writer, size_t len);
+bool list_writer_flush(ListWriter *writer);
+const char *lookup_name(bool group, unsigned int id);
+void listing_cache_init();
+ListingEntry *listing_cache_get(const char *path, bool extended);
+void listing_cache_release(ListingEntry *entry);
+void listing_cache_put(const char *path, bool extended, int wd,
+                       unsigned long epoch, char *data, size_t len);
+void listing_cache_events();
+void listing_cache_unlink(ListingEntry **link);
+int listing_watch_add(const char *path);
+void listing_watch_release(int wd);
+double elapsed_seconds(struct timespec *start);
+bool send_all(int socket, const char *buffer, size_t len);
+size_t throttle_quantum(int socket, size_t want);
+void throttle_charge(int socket, size_t bytes);
+bool send_file(int socket, const char *filename, off_t offset,
+               DataFilter *filter);
+bool send_open_file(int socket, int file_fd, off_t offset,
+                    DataFilter *filter);
+off_t send_file_range(int socket, int file_fd, off_t offset, off_t end);
+int prefetch_file(const char *filename);
+bool send_file_splice(int socket, int file_fd);
+bool send_cached_file(int socket, const char *filename, off_t offset,
+                      DataFilter *filter, bool *ok);
+FileEntry *file_cache_get(const char *filename, struct stat *file_stat);
+FileEntry *file_cache_load(const char *filename, struct stat *file_stat);
+void file_cache_release(FileEntry *entry);
+void file_cache_unlink(FileEntry **link);
+bool archive_source(const char *path, char *dir_path, bool *zip);
+bool send_archive(int socket, const char *dir_path, bool zip,
+                  DataFilter *filter);
+bool archive_directory(ArchiveWriter *writer, int dir_fd, size_t name_len);
+bool archive_write(ArchiveWriter *writer, const void *data, size_t len);
+bool archive_pad(ArchiveWriter *writer);
+bool tar_entry(ArchiveWriter *writer, int file_fd, struct stat *file_stat);
+bool tar_header(ArchiveWriter *writer, const char *name, char type,
+                off_t size, struct stat *file_stat);
+void tar_number(char *field, size_t width, unsigned long long value);
+bool zip_entry(ArchiveWriter *writer, int file_fd, struct stat *file_stat);
+bool zip_deflate(ArchiveWriter *writer, int file_fd, ZipEntry *entry);
+bool zip_finish(ArchiveWriter *writer);
+bool zip_fits(ArchiveWriter *writer, off_t size);
+unsigned char *put16(unsigned char *p, uint16_t value);
+unsigned char *put32(unsigned char *p, uint32_t value);
+bool filter_begin(ClientConnection *conn, int socket, const char *name,
+                  FilterKind kind, DataFilter **filter);
+bool filter_end(DataFilter *filter, const char *name, bool ok);
+bool filter_write(DataFilter *filter, const void *data, size_t len,
+                  int flush);
+bool filter_send(DataFilter *filter, const void *data, size_t len,
+                 int flush);
+bool filter_store(DataFilter *filter, int file_fd, const void *data,
+                  size_t len, ssize_t *total);
+off_t filter_file(DataFilter *filter, int file_fd, off_t offset, off_t end);
+off_t filter_file_uring(Uring *ring, DataFilter *filter, int file_fd,
+                        off_t offset, off_t end);
+void filter_level(DataFilter *filter, const char *name);
+bool compressed_name(const char *name);
+ssize_t receive_file_filtered(DataFilter *filter, int file_fd);
+bool create_pipe(int pipe_fd[2]);
+bool write_all(int fd, const char *buffer, size_t len);
+bool receive_file(int socket, const char *filename, off_t alloc_size,
+                  off_t offset, bool append, DataFilter *filter);
+bool store_file(ClientConnection *conn, const char *arg, bool append);
+void build_path(ClientConnection *conn, const char *arg, char *full_path);
+unsigned int hash_path(const char *path);
+bool cached_stat(const char *path, struct stat *file_stat);
+void stat_cache_invalidate(const char *path);
+bool file_digest(const char *path, DigestType type, off_t start, off_t end,
+                 char *hex, off_t *size);
+bool parse_range(const char *arg, char *name, off_t *start, off_t *end);
+bool send_checksum(ClientConnection *conn, const char *arg, DigestType type);
+ssize_t receive_file_splice(int socket, int file_fd);
+ssize_t receive_file_copy(int socket, int file_fd);
+ssize_t receive_file_uring(Uring *ring, int socket, int file_fd,
+                           off_t offset);
 void change_directory(ClientConnection *conn, const char *path);
 void get_local_ip();
 
 int main(int argc, char *argv[]) {
+  log_init();
+  log_info(LOG_ASCII_KERNEL, ascii_init());
+  log_info(LOG_DIGEST_KERNEL, digest_init());
 
   if (argc == 2) {
     // Only server IP is provided, use default port
     server_port = DEFAULT_PORT;
     strncpy(server_ip, argv[1], 16);
     server_ip[15] = '\0';
-  } else if (argc == 3) {
+  } else if (argc == 3 || argc == 4) {
     // Both port and server IP are provided
     server_port = atoi(argv[1]);
     strncpy(server_ip, argv[2], 16);
@@ -153,61 +731,69 @@ int main(int argc, char *argv[]) {
       fprintf(stderr, ERR_PORT_FAIL, server_port);
       return 1;
     }
+
+    if (argc == 4 &&
+        (sscanf(argv[3], "%d-%d", &pasv_port_min, &pasv_port_max) != 2 ||
+         pasv_port_min <= 0 || pasv_port_max > 65535 ||
+         pasv_port_min > pasv_port_max)) {
+      fprintf(stderr, ERR_PASV_RANGE_FAIL, argv[3]);
+      return 1;
+    }
   } else {
     get_local_ip();
     // fprintf(stderr, "Usage: %s [port] [server_ip] or %s [server_ip]\n",
     // argv[0], argv[0]); return 1;
   }
 
-  printf(LOG_SERVER_INFO, server_ip, server_port);
+  log_info(LOG_SERVER_INFO, server_ip, server_port);
 
-  int server_socket = create_server_socket(server_port);
-  if (server_socket < 0) {
+  if (!shards_open(server_port)) {
     exit(EXIT_FAILURE);
   }
 
-  while (1) {
-    ClientConnection conn;
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-
-    conn.control_socket =
-        accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
-    if (conn.control_socket < 0) {
-      perror(ERR_ACCEPT_FAIL);
-      continue;
-    }
+  // a data connection that is shut down or reset under a transfer fails it
+  // with EPIPE instead of killing the server
+  signal(SIGPIPE, SIG_IGN);
 
-    printf(MSG_NEW_CLIENT, inet_ntoa(client_addr.sin_addr));
-    conn.data_socket = create_data_socket();
-    conn.client_addr = client_addr.sin_addr;
-    if (getcwd(conn.current_dir, MAX_PATH) != NULL) {
+  idle_timeout = timer_limit("FTP_IDLE_TIMEOUT", IDLE_TIMEOUT);
+  accept_timeout = timer_limit("FTP_ACCEPT_TIMEOUT", ACCEPT_TIMEOUT);
+  stall_timeout = timer_limit("FTP_STALL_TIMEOUT", STALL_TIMEOUT);
+  if (!timer_init()) {
+    exit(EXIT_FAILURE);
+  }
+  log_info(LOG_TIMEOUTS, idle_timeout, accept_timeout, stall_timeout);
+  rate_init("FTP");
 
-      printf(LOG_CWD, conn.current_dir);
-    } else {
+  if (getcwd(root_dir, MAX_PATH) != NULL) {
+    log_info(LOG_CWD, root_dir);
+  } else {
+    log_perror(ERR_GETCWD_FAIL);
+    return 1;
+  }
 
-      perror(ERR_GETCWD_FAIL);
-      return 1;
-    }
+  build_command_table();
+  listing_cache_init();
+  port_pool_init(pasv_port_min, pasv_port_max);
 
-    if (conn.data_socket < 0) {
-      send_response(conn.control_socket, MSG_DATA_CONN_FAIL);
-      close(conn.control_socket);
-      continue;
+  for (int i = 0; i < WORKER_THREADS; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, worker_thread, NULL) != 0) {
+      log_perror(ERR_THREAD_FAIL);
+      exit(EXIT_FAILURE);
     }
-
-    handle_client(&conn);
+    pthread_detach(thread);
   }
 
-  close(server_socket);
+  shards_run();
   return 0;
 }
 
-int create_server_socket(int port) {
+// Listening socket on port, shards share the port with SO_REUSEPORT
+int create_server_socket(int port, bool reuse_port, int backlog) {
   int server_socket = socket(AF_INET, SOCK_STREAM, 0);
   if (server_socket == -1) {
 
-    perror(ERR_SOCKET_FAIL);
+    log_perror(ERR_SOCKET_FAIL);
     return -1;
   }
 
@@ -219,22 +805,32 @@ int create_server_socket(int port) {
   if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &enable,
                  sizeof(int)) < 0) {
 
-    perror(ERR_SETSOCKOPT_FAIL);
+    log_perror(ERR_SETSOCKOPT_FAIL);
+    close(server_socket);
+    return -1;
+  }
+
+  if (reuse_port && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT,
+                               &enable, sizeof(int)) < 0) {
+    log_perror(ERR_REUSEPORT_FAIL);
     close(server_socket);
     return -1;
   }
 
+  // the event loop drains the accept queue until EAGAIN
+  fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL) | O_NONBLOCK);
+
   if (bind(server_socket, (struct sockaddr *)&server_addr,
            sizeof(server_addr)) < 0) {
 
-    perror(ERR_BIND_FAIL);
+    log_perror(ERR_BIND_FAIL);
     close(server_socket);
     return -1;
   }
 
-  if (listen(server_socket, MAX_CLIENTS) < 0) {
+  if (listen(server_socket, backlog) < 0) {
 
-    perror(ERR_LISTEN_FAIL);
+    log_perror(ERR_LISTEN_FAIL);
     close(server_socket);
     return -1;
   }
@@ -242,25 +838,96 @@ int create_server_socket(int port) {
   return server_socket;
 }
 
-int create_data_socket() {
+// Opens the listener of every shard and, for the io_uring engine, their
+// rings. A kernel without io_uring gets epoll. False when the port can't
+// be listened on.
+bool shards_open(int port) {
+  const char *engine = getenv("FTP_ENGINE");
+  int backlog = shard_backlog("FTP_BACKLOG");
+
+  shard_total = shard_count("FTP_SHARDS");
+  shards = calloc(shard_total, sizeof(Shard));
+  if (shards == NULL) {
+    log_perror(ERR_ALLOC_FAIL);
+    return false;
+  }
+
+  uring_engine = engine != NULL && strcmp(engine, "io_uring") == 0;
+  for (int i = 0; i < shard_total; i++) {
+    Shard *shard = &shards[i];
+    shard->id = i;
+    shard->epoll_fd = -1;
+    shard->server_socket =
+        create_server_socket(port, shard_total > 1, backlog);
+    if (shard->server_socket < 0)
+      return false;
+
+    pthread_mutex_init(&shard->control.lock, NULL);
+    if (uring_engine && !uring_init(&shard->control.ring,
+                                    CONTROL_RING_ENTRIES, 0, 0)) {
+      log_perror(ERR_URING_FAIL);
+      for (int j = 0; j < i; j++)
+        uring_free(&shards[j].control.ring);
+      uring_engine = false;
+    }
+  }
+  log_info(LOG_ENGINE, uring_engine ? "io_uring" : "epoll", shard_total,
+           backlog);
+  return true;
+}
+
+// Shard 0 runs on the calling thread, the others on threads of their own
+void shards_run() {
+  for (int i = 1; i < shard_total; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, shard_thread, &shards[i]) != 0) {
+      log_perror(ERR_THREAD_FAIL);
+      exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+  }
+  shard_thread(&shards[0]);
+}
+
+void *shard_thread(void *arg) {
+  Shard *shard = arg;
+
+  if (shard_total > 1)
+    shard_pin(shard->id);
+  if (uring_engine)
+    uring_event_loop(shard);
+  else
+    event_loop(shard);
+  close(shard->server_socket);
+  return NULL;
+}
+
+// Passive listeners block, accept_data_connection() waits in the accept
+// until the client connects or the accept timeout shuts the listener down
+int create_data_socket(int port) {
   int sock = socket(AF_INET, SOCK_STREAM, 0);
   if (sock < 0) {
 
-    perror(ERR_SOCKET_FAIL);
+    log_perror(ERR_SOCKET_FAIL);
     return -1;
   }
 
-  struct sockaddr_in addr = {
-      .sin_family = AF_INET, .sin_addr.s_addr = INADDR_ANY, .sin_port = 0};
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_addr.s_addr = INADDR_ANY,
+                             .sin_port = htons(port)};
+
+  int enable = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
 
   if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-    perror(ERR_BIND_FAIL);
+    if (port == 0)
+      log_perror(ERR_BIND_FAIL);
     close(sock);
     return -1;
   }
 
   if (listen(sock, 1) < 0) {
-    perror(ERR_LISTEN_FAIL);
+    log_perror(ERR_LISTEN_FAIL);
     close(sock);
     return -1;
   }
@@ -268,39 +935,563 @@ int create_data_socket() {
   return sock;
 }
 
-void handle_client(ClientConnection *conn) {
-  char buffer[BUFFER_SIZE];
-  ssize_t bytes_received;
+// Binds every free port of the range up front, ports already taken by
+// someone else are skipped.
+void port_pool_init(int min_port, int max_port) {
+  port_pool.sockets = calloc(max_port - min_port + 1, sizeof(int));
+  if (port_pool.sockets == NULL) {
+    log_perror(ERR_ALLOC_FAIL);
+    exit(EXIT_FAILURE);
+  }
 
-  struct sockaddr_in addr;
-  socklen_t len = sizeof(addr);
-  getsockname(conn->data_socket, (struct sockaddr *)&addr, &len);
+  for (int port = min_port; port <= max_port; port++) {
+    int sock = create_data_socket(port);
+    if (sock >= 0)
+      port_pool.sockets[port_pool.count++] = sock;
+  }
+  log_info(LOG_PORT_POOL, min_port, max_port, port_pool.count);
+}
 
-  send_response(conn->control_socket, MSG_WELCOME);
+int port_pool_acquire() {
+  pthread_mutex_lock(&port_pool.lock);
+  int sock = port_pool.count > 0 ? port_pool.sockets[--port_pool.count] : -1;
+  pthread_mutex_unlock(&port_pool.lock);
+
+  // drop connections left queued by a previous session
+  if (sock >= 0) {
+    struct pollfd pfd = {.fd = sock, .events = POLLIN};
+    int stale;
+    while (poll(&pfd, 1, 0) > 0 && (stale = accept(sock, NULL, NULL)) >= 0)
+      close(stale);
+  }
+  return sock;
+}
 
-  while (1) {
-    memset(buffer, 0, BUFFER_SIZE);
-    bytes_received = recv(conn->control_socket, buffer, BUFFER_SIZE - 1, 0);
+void port_pool_release(int sock) {
+  pthread_mutex_lock(&port_pool.lock);
+  port_pool.sockets[port_pool.count++] = sock;
+  pthread_mutex_unlock(&port_pool.lock);
+}
+
+// Waits for the client to connect to the passive port. The connection is
+// watched by the stall timer until close_data_connection().
+int accept_data_connection(ClientConnection *conn) {
+  if (conn->data_socket < 0) {
+    errno = ENOTCONN; // no PASV before the transfer
+    return -1;
+  }
+
+  if (accept_timeout > 0) {
+    timer_setup(&conn->data_timer, data_accept_expired, conn);
+    timer_arm(&conn->data_timer, accept_timeout * 1000L);
+  }
+  int sock = accept_data_wait(conn);
+  timer_cancel(&conn->data_timer);
+
+  if (sock < 0 && conn->accept_timed_out) {
+    errno = ETIMEDOUT;
+    return sock;
+  }
+  if (sock < 0)
+    return sock;
+
+  conn->transfer_socket = sock;
+  if (rate_enabled())
+    throttled = conn;
+  if (stall_timeout > 0) {
+    conn->transfer_progress = 0;
+    timer_setup(&conn->data_timer, transfer_stall_expired, conn);
+    timer_arm(&conn->data_timer, stall_timeout * 1000L);
+  }
+  return sock;
+}
 
-    if (bytes_received <= 0) {
-      printf(bytes_received == 0 ? ERR_CLIENT_DISCONNECT : ERR_RECV_FAIL);
+int accept_data_wait(ClientConnection *conn) {
+  // on a blocking listener the io_uring accept waits in the kernel, waiting
+  // and accepting is a single system call
+  Uring *ring = worker_ring();
+  struct io_uring_sqe *sqe = ring != NULL ? uring_sqe(ring) : NULL;
+  if (sqe != NULL) {
+    uring_prep(sqe, IORING_OP_ACCEPT, conn->data_socket, NULL, 0, 0,
+               URING_ACCEPT_TAG);
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_wait(ring)) != NULL) {
+      bool ours = cqe->user_data == URING_ACCEPT_TAG;
+      int sock = cqe->res;
+      uring_seen(ring);
+      if (!ours)
+        continue;
+      if (sock >= 0)
+        return sock;
+      errno = -sock;
+      if (errno != EAGAIN && errno != EINTR)
+        return -1;
       break;
     }
+    if (cqe == NULL) {
+      // the accept must not take the next connection for nobody
+      log_perror(ERR_URING_FAIL);
+      uring_cancel(ring, URING_ACCEPT_TAG);
+      worker_ring_drain(ring);
+      return -1;
+    }
+  }
+
+  int sock;
+  while ((sock = accept(conn->data_socket, NULL, NULL)) < 0 && errno == EINTR)
+    ;
+  return sock;
+}
+
+// False if the stall timer aborted the transfer, to an upload the shutdown
+// looks like the end of the file
+bool close_data_connection(ClientConnection *conn, int sock) {
+  bool stalled;
+
+  // the timer must not shut down whatever gets the descriptor next
+  timer_cancel(&conn->data_timer);
+  close(sock);
+  conn->transfer_socket = -1;
+  throttled = NULL;
+  stalled = conn->transfer_stalled;
+  conn->transfer_stalled = false;
+  return !stalled;
+}
+
+void release_data_socket(ClientConnection *conn) {
+  if (conn->data_socket < 0)
+    return;
+
+  // a listener shut down by the accept timeout has to listen again
+  bool listening =
+      !conn->accept_timed_out || listen(conn->data_socket, 1) == 0;
+  conn->accept_timed_out = false;
+  if (conn->data_pooled && listening)
+    port_pool_release(conn->data_socket);
+  else
+    close(conn->data_socket);
+  conn->data_socket = -1;
+}
+
+void event_loop(Shard *shard) {
+  struct epoll_event events[MAX_EVENTS];
+  int server_socket = shard->server_socket;
+  int epoll_fd = epoll_create1(0);
+
+  shard->epoll_fd = epoll_fd;
+  if (epoll_fd < 0) {
+    log_perror(ERR_EPOLL_FAIL);
+    exit(EXIT_FAILURE);
+  }
+
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &ev) < 0) {
+    log_perror(ERR_EPOLL_FAIL);
+    exit(EXIT_FAILURE);
+  }
+
+  // listing cache invalidations are handled by the first shard
+  if (listing_cache.inotify_fd >= 0 && shard->id == 0) {
+    ev.data.ptr = &listing_cache;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listing_cache.inotify_fd, &ev);
+  }
+
+  while (1) {
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      log_perror(ERR_EPOLL_FAIL);
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      ClientConnection *conn = events[i].data.ptr;
+
+      if (events[i].data.ptr == &listing_cache) {
+        listing_cache_events();
+      } else if (conn == NULL) {
+        // listening socket: accept every pending connection
+        while (1) {
+          struct sockaddr_in client_addr;
+          socklen_t client_len = sizeof(client_addr);
+          int control_socket = accept(
+              server_socket, (struct sockaddr *)&client_addr, &client_len);
+          if (control_socket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+              log_perror(ERR_ACCEPT_FAIL);
+            break;
+          }
+          session_open(control_socket, &client_addr, shard);
+        }
+      } else {
+        log_set_context(conn->id, NULL);
+        session_read(conn);
+      }
+    }
+    log_set_context(0, NULL);
+  }
+}
+
+// Queues a request on the control ring. Requests queued by the event loop
+// go in with its next wait, the ones from workers are submitted right away.
+bool control_ring_queue(ControlRing *control, int op, int fd, void *addr,
+                        unsigned len, void *user_data) {
+  pthread_mutex_lock(&control->lock);
+  struct io_uring_sqe *sqe = uring_sqe(&control->ring);
+  if (sqe != NULL) {
+    uring_prep(sqe, op, fd, addr, len, 0, (uintptr_t)user_data);
+    if (op == IORING_OP_ACCEPT)
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    else if (op == IORING_OP_POLL_ADD) {
+      sqe->len = IORING_POLL_ADD_MULTI;
+      sqe->poll32_events = POLLIN;
+    }
+  }
+  unsigned count = uring_flush(&control->ring);
+  pthread_mutex_unlock(&control->lock);
 
-    buffer[bytes_received] = '\0';
-    printf(LOG_RECEIVED, inet_ntoa(conn->client_addr), buffer);
+  if (sqe == NULL)
+    return false;
+  if (event_loop_thread)
+    control->queued += count;
+  else if (uring_enter(&control->ring, count, 0) < 0)
+    return false;
+  return true;
+}
+
+// event_loop() on io_uring: the listening socket has a multishot accept and
+// the inotify descriptor a multishot poll, both stay armed. Each idle
+// session has a recv straight into its buffer, so a command costs no
+// readiness notification and no separate read.
+void uring_event_loop(Shard *shard) {
+  ControlRing *control = &shard->control;
+  Uring *ring = &control->ring;
+  int server_socket = shard->server_socket;
+
+  event_loop_thread = true;
+  control_ring_queue(control, IORING_OP_ACCEPT, server_socket, NULL, 0, NULL);
+  if (listing_cache.inotify_fd >= 0 && shard->id == 0)
+    control_ring_queue(control, IORING_OP_POLL_ADD, listing_cache.inotify_fd,
+                       NULL, 0, &listing_cache);
 
-    if (handle_command(conn, buffer)) {
-      // Close the connection if handle_command returns true
+  while (1) {
+    unsigned queued = control->queued;
+    control->queued = 0;
+    if (uring_enter(ring, queued, 1) < 0) {
+      log_perror(ERR_URING_FAIL);
       break;
     }
-    fflush(stdout);
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = uring_cqe(ring)) != NULL) {
+      ClientConnection *conn = (ClientConnection *)(uintptr_t)cqe->user_data;
+      bool more = cqe->flags & IORING_CQE_F_MORE;
+      int result = cqe->res;
+      uring_seen(ring);
+
+      if ((void *)conn == &listing_cache) {
+        listing_cache_events();
+        if (!more)
+          control_ring_queue(control, IORING_OP_POLL_ADD,
+                             listing_cache.inotify_fd, NULL, 0,
+                             &listing_cache);
+      } else if (conn == NULL) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        if (result >= 0 &&
+            getpeername(result, (struct sockaddr *)&client_addr,
+                        &client_len) == 0) {
+          session_open(result, &client_addr, shard);
+        } else if (result >= 0) {
+          close(result);
+        } else if (result != -EAGAIN && result != -EINTR) {
+          errno = -result;
+          log_perror(ERR_ACCEPT_FAIL);
+        }
+        if (!more)
+          control_ring_queue(control, IORING_OP_ACCEPT, server_socket, NULL, 0,
+                             NULL);
+      } else {
+        log_set_context(conn->id, NULL);
+        if (result < 0)
+          errno = -result;
+        session_received(conn, result < 0 ? -1 : result);
+      }
+    }
+    log_set_context(0, NULL);
+  }
+}
+
+// A worker's own ring with registered buffers, set up on first use. NULL
+// with the epoll engine or when the ring can't be set up (the buffers are
+// locked memory), the callers then use the plain system calls.
+Uring *worker_ring() {
+  if (worker_uring != NULL || worker_uring_failed || !uring_engine)
+    return worker_uring;
+
+  worker_uring = malloc(sizeof(Uring));
+  if (worker_uring == NULL ||
+      !uring_init(worker_uring, WORKER_RING_ENTRIES, WORKER_RING_BUFFERS,
+                  RECV_CHUNK)) {
+    log_perror(ERR_URING_FAIL);
+    free(worker_uring);
+    worker_uring = NULL;
+    worker_uring_failed = true;
+  }
+  return worker_uring;
+}
+
+// Run when a transfer gives up with requests still in flight, their
+// completions would be taken for the next transfer's. A ring that can't
+// even wait for them is dropped without being freed, the kernel may still
+// write to its buffers.
+void worker_ring_drain(Uring *ring) {
+  if (uring_drain(ring))
+    return;
+  log_perror(ERR_URING_FAIL);
+  worker_uring = NULL;
+  worker_uring_failed = true;
+}
+
+// Commands only store last_active, the idle timer checks it when it goes off
+// and arms itself again for whatever is left. Busy sessions are left alone,
+// their transfers have timeouts of their own. Shutting the socket down has
+// the event loop see the end of the connection and close the session.
+long session_idle_expired(Timer *timer) {
+  ClientConnection *conn = timer->data;
+  long limit = idle_timeout * 1000L;
+  long idle =
+      timer_now() - __atomic_load_n(&conn->last_active, __ATOMIC_RELAXED);
+
+  if (__atomic_load_n(&conn->state, __ATOMIC_RELAXED) == SESSION_BUSY)
+    return limit;
+  if (idle < limit)
+    return limit - idle;
+
+  log_set_context(conn->id, NULL);
+  log_info(LOG_IDLE_TIMEOUT, idle_timeout);
+  log_set_context(0, NULL);
+  send(conn->control_socket, MSG_IDLE_TIMEOUT, strlen(MSG_IDLE_TIMEOUT),
+       MSG_DONTWAIT | MSG_NOSIGNAL);
+  shutdown(conn->control_socket, SHUT_RDWR);
+  return 0;
+}
+
+// Shutting the listener down fails the accept waiting on it (EINVAL)
+long data_accept_expired(Timer *timer) {
+  ClientConnection *conn = timer->data;
+
+  conn->accept_timed_out = true;
+  shutdown(conn->data_socket, SHUT_RD);
+  return 0;
+}
+
+// Progress is what the kernel counts on the data connection, bytes the
+// client acknowledged or sent, so whatever path the transfer takes
+// (sendfile, splice, io_uring) doesn't have to report it. A stalled
+// connection is shut down, which fails the send or receive blocked on it.
+long transfer_stall_expired(Timer *timer) {
+  ClientConnection *conn = timer->data;
+  TcpInfo info;
+  socklen_t len = sizeof(info);
+
+  // without the counters there is no telling, the transfer is left alone
+  if (getsockopt(conn->transfer_socket, IPPROTO_TCP, TCP_INFO, &info,
+                 &len) != 0 ||
+      len < sizeof(info))
+    return stall_timeout * 1000L;
+
+  unsigned long long progress = info.bytes_acked + info.bytes_received;
+  if (progress != conn->transfer_progress) {
+    conn->transfer_progress = progress;
+    return stall_timeout * 1000L;
+  }
+
+  log_set_context(conn->id, NULL);
+  log_warn(LOG_STALLED, stall_timeout);
+  log_set_context(0, NULL);
+  conn->transfer_stalled = true;
+  shutdown(conn->transfer_socket, SHUT_RDWR);
+  return 0;
+}
+
+void *worker_thread(void *arg) {
+  while (1) {
+    ClientConnection *conn = work_queue_pop();
+    log_set_context(conn->id, NULL);
+
+    if (session_process(conn)) {
+      // Close the connection if a command asked for it
+      session_close(conn);
+    } else {
+      __atomic_store_n(&conn->last_active, timer_now(), __ATOMIC_RELAXED);
+      conn->state = SESSION_IDLE;
+      session_arm(conn, EPOLL_CTL_MOD);
+    }
+    log_set_context(0, NULL);
+  }
+  return NULL;
+}
+
+void session_open(int control_socket, struct sockaddr_in *client_addr,
+                  Shard *shard) {
+  ClientConnection *conn = calloc(1, sizeof(ClientConnection));
+  if (conn == NULL) {
+    log_perror(ERR_ALLOC_FAIL);
+    close(control_socket);
+    return;
+  }
+
+  conn->control_socket = control_socket;
+  conn->shard = shard;
+  conn->last_active = timer_now();
+  timer_setup(&conn->idle_timer, session_idle_expired, conn);
+  timer_setup(&conn->data_timer, NULL, conn);
+  if (idle_timeout > 0)
+    timer_arm(&conn->idle_timer, idle_timeout * 1000L);
+  conn->client_addr = client_addr->sin_addr;
+  inet_ntop(AF_INET, &conn->client_addr, conn->client_ip,
+            sizeof(conn->client_ip));
+  strncpy(conn->current_dir, root_dir, sizeof(conn->current_dir) - 1);
+  conn->data_socket = -1;
+  conn->transfer_socket = -1;
+  rate_open(&conn->rate, conn->client_ip);
+  conn->id = __atomic_add_fetch(&last_session_id, 1, __ATOMIC_RELAXED);
+  log_set_context(conn->id, NULL);
+  log_info(MSG_NEW_CLIENT, conn->client_ip);
+
+  send_response(conn->control_socket, MSG_WELCOME);
+  conn->state = SESSION_IDLE;
+  session_arm(conn, EPOLL_CTL_ADD);
+}
+
+// Control sockets are registered one-shot so that a session is never seen by
+// the loop while a worker owns it; the worker re-arms it when done. With
+// io_uring arming is queueing the recv itself.
+void session_arm(ClientConnection *conn, int op) {
+  if (uring_engine) {
+    if (!control_ring_queue(&conn->shard->control, IORING_OP_RECV,
+                            conn->control_socket,
+                            conn->buffer + conn->buffered,
+                            BUFFER_SIZE - conn->buffered, conn)) {
+      log_perror(ERR_URING_FAIL);
+      session_close(conn);
+    }
+    return;
+  }
+
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+                           .data.ptr = conn};
+  if (epoll_ctl(conn->shard->epoll_fd, op, conn->control_socket, &ev) < 0) {
+    log_perror(ERR_EPOLL_FAIL);
+    session_close(conn);
+  }
+}
+
+// Appends what arrived to the session buffer, a worker is only woken up
+// once there is at least one complete line (or the buffer is full).
+void session_read(ClientConnection *conn) {
+  session_received(conn, recv(conn->control_socket,
+                              conn->buffer + conn->buffered,
+                              BUFFER_SIZE - conn->buffered, 0));
+}
+
+// The second half of session_read(), bytes_received have been appended
+void session_received(ClientConnection *conn, ssize_t bytes_received) {
+  char *end = conn->buffer + conn->buffered;
+
+  if (bytes_received <= 0) {
+    log_info("%s", bytes_received == 0 ? ERR_CLIENT_DISCONNECT : ERR_RECV_FAIL);
+    session_close(conn);
+    return;
+  }
+
+  conn->buffered += bytes_received;
+  __atomic_store_n(&conn->last_active, timer_now(), __ATOMIC_RELAXED);
+  if (memchr(end, '\n', bytes_received) == NULL &&
+      conn->buffered < BUFFER_SIZE) {
+    session_arm(conn, EPOLL_CTL_MOD);
+    return;
+  }
+
+  conn->state = SESSION_BUSY;
+  work_queue_push(conn);
+}
+
+// Runs every complete command in the buffer, pipelined commands included,
+// and keeps the trailing partial line for the next read. Returns true when
+// the session has to be closed.
+bool session_process(ClientConnection *conn) {
+  char *line = conn->buffer;
+  char *end = conn->buffer + conn->buffered;
+  char *newline;
+
+  while ((newline = memchr(line, '\n', end - line)) != NULL) {
+    char *next = newline + 1;
+    if (conn->skip_line) {
+      conn->skip_line = false;
+      line = next;
+      continue;
+    }
+
+    *newline = '\0';
+    if (newline > line && newline[-1] == '\r')
+      newline[-1] = '\0';
+    log_debug(LOG_RECEIVED, conn->client_ip, line);
+    if (handle_command(conn, line))
+      return true;
+    line = next;
   }
 
-  printf(LOG_CLOSING, inet_ntoa(conn->client_addr));
+  size_t rest = end - line;
+  if (rest == BUFFER_SIZE || (conn->skip_line && rest > 0)) {
+    // a line that doesn't fit the buffer can't be a valid command
+    if (!conn->skip_line)
+      send_response(conn->control_socket, MSG_SYNTAX_ERROR);
+    conn->skip_line = true;
+    rest = 0;
+  }
+  memmove(conn->buffer, line, rest);
+  conn->buffered = rest;
+  return false;
+}
+
+void session_close(ClientConnection *conn) {
+  log_info(LOG_CLOSING, conn->client_ip);
 
-  close(conn->data_socket);
+  timer_cancel(&conn->idle_timer);
+  timer_cancel(&conn->data_timer);
+
+  // closing the socket also removes it from the epoll set
+  release_data_socket(conn);
   close(conn->control_socket);
+  rate_close(&conn->rate);
+  free(conn);
+}
+
+void work_queue_push(ClientConnection *conn) {
+  pthread_mutex_lock(&work_queue.lock);
+  conn->next = NULL;
+  if (work_queue.tail)
+    work_queue.tail->next = conn;
+  else
+    work_queue.head = conn;
+  work_queue.tail = conn;
+  pthread_cond_signal(&work_queue.ready);
+  pthread_mutex_unlock(&work_queue.lock);
+}
+
+ClientConnection *work_queue_pop() {
+  pthread_mutex_lock(&work_queue.lock);
+  while (work_queue.head == NULL)
+    pthread_cond_wait(&work_queue.ready, &work_queue.lock);
+  ClientConnection *conn = work_queue.head;
+  work_queue.head = conn->next;
+  if (work_queue.head == NULL)
+    work_queue.tail = NULL;
+  pthread_mutex_unlock(&work_queue.lock);
+  return conn;
 }
 
 void send_response(int socket, const char *format, ...) {
@@ -310,22 +1501,77 @@ void send_response(int socket, const char *format, ...) {
   vsnprintf(buffer, sizeof(buffer), format, args);
   va_end(args);
 
-  if (send(socket, buffer, strlen(buffer), 0) < 0) {
-    perror(ERR_SEND_FAIL);
+  if (!send_all(socket, buffer, strlen(buffer))) {
+    log_perror(ERR_SEND_FAIL);
+  }
+
+  log_debug(LOG_SENT, (int)strcspn(buffer, "\r\n"), buffer);
+}
+
+// Sends the listing of path from the cache, or renders it and caches it.
+void send_listing(int socket, const char *path, bool extended,
+                  DataFilter *filter) {
+  static __thread ListWriter *writer = NULL;
+
+  ListingEntry *entry = listing_cache_get(path, extended);
+  if (entry != NULL) {
+    log_write(LOG_LEVEL_DEBUG, entry->len, -1, LOG_LIST_CACHED, path);
+    if (filter != NULL)
+      filter_write(filter, entry->data, entry->len, Z_NO_FLUSH);
+    else if (!send_all(socket, entry->data, entry->len))
+      log_perror(ERR_SEND_FAIL);
+    listing_cache_release(entry);
+    return;
+  }
+
+  if (writer == NULL && (writer = malloc(sizeof(ListWriter))) == NULL) {
+    log_perror(ERR_ALLOC_FAIL);
+    return;
+  }
+  writer->socket = socket;
+  writer->filter = filter;
+  writer->count = 0;
+  writer->used = 0;
+  writer->capture = NULL;
+  writer->capture_len = 0;
+  writer->capture_size = 0;
+
+  // watch before reading so no change can slip in between
+  unsigned long epoch = 0;
+  int wd = -1;
+  if (listing_cache.inotify_fd >= 0) {
+    pthread_mutex_lock(&listing_cache.lock);
+    epoch = listing_cache.epoch;
+    wd = listing_watch_add(path);
+    pthread_mutex_unlock(&listing_cache.lock);
+    if (wd >= 0) {
+      writer->capture_size = LIST_CHUNK * LIST_IOV;
+      writer->capture = malloc(writer->capture_size);
+    }
   }
 
-  printf(LOG_SENT, buffer);
+  bool complete = extended ? list_directory_extend(writer, path)
+                           : list_directory(writer, path);
+
+  if (complete && writer->capture != NULL) {
+    listing_cache_put(path, extended, wd, epoch, writer->capture,
+                      writer->capture_len);
+  } else if (wd >= 0) {
+    free(writer->capture);
+    pthread_mutex_lock(&listing_cache.lock);
+    listing_watch_release(wd);
+    pthread_mutex_unlock(&listing_cache.lock);
+  }
 }
 
-void list_directory(int socket, const char *path) {
+bool list_directory(ListWriter *writer, const char *path) {
   DIR *dir;
   struct dirent *entry;
-  char buffer[BUFFER_SIZE];
 
   dir = opendir(path);
   if (dir == NULL) {
-    perror(ERR_OPEN_DIR);
-    return;
+    log_perror(ERR_OPEN_DIR);
+    return false;
   }
 
   while ((entry = readdir(dir)) != NULL) {
@@ -333,51 +1579,51 @@ void list_directory(int socket, const char *path) {
     if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
       continue;
     }
-    snprintf(buffer, BUFFER_SIZE, "%s\r\n", entry->d_name);
-    send(socket, buffer, strlen(buffer), 0);
+    size_t len = strlen(entry->d_name);
+    char *line = list_writer_reserve(writer, len + 2);
+    if (line == NULL) {
+      closedir(dir);
+      return false;
+    }
+    memcpy(line, entry->d_name, len);
+    memcpy(line + len, "\r\n", 2);
+    writer->used += len + 2;
   }
 
   closedir(dir);
+  return list_writer_flush(writer);
 }
 
-void list_directory_extend(int socket, const char *path) {
+// Entries are stat'ed relative to the directory fd, so the kernel doesn't
+// walk the whole path again for each one, and owner names come from the
+// shared name cache instead of hitting the passwd/group databases.
+bool list_directory_extend(ListWriter *writer, const char *path) {
   DIR *dir;
   struct dirent *entry;
-  char buffer[BUFFER_SIZE];
+  struct timespec start;
+  int entries = 0;
 
+  clock_gettime(CLOCK_MONOTONIC, &start);
   dir = opendir(path);
   if (dir == NULL) {
 
-    perror(ERR_OPEN_DIR);
-    return;
+    log_perror(ERR_OPEN_DIR);
+    return false;
   }
 
-  // while ((entry = readdir(dir)) != NULL) {
-  //   snprintf(buffer, BUFFER_SIZE, "%s\r\n", entry->d_name);
-  //   send(socket, buffer, strlen(buffer), 0);
-  // }
-
   struct stat file_stat;
-  char file_path[BUFFER_SIZE];
   char time_buffer[100];
-  struct tm *tm_info;
-
-  struct passwd *pw;
-  struct group *gr;
+  time_t time_minute = -1;
+  struct tm tm_info;
   char permissions[11];
+  int dir_fd = dirfd(dir);
 
   while ((entry = readdir(dir)) != NULL) {
-    snprintf(file_path, BUFFER_SIZE, "%s/%s", path, entry->d_name);
-
-    if (stat(file_path, &file_stat) == -1) {
-      perror("stat");
+    if (fstatat(dir_fd, entry->d_name, &file_stat, 0) == -1) {
+      log_perror("stat");
       continue;
     }
 
-    // Get the user and group names
-    pw = getpwuid(file_stat.st_uid);
-    gr = getgrgid(file_stat.st_gid);
-
     // Get the permissions
     snprintf(permissions, sizeof(permissions), "%c%c%c%c%c%c%c%c%c%c",
              (S_ISDIR(file_stat.st_mode)) ? 'd' : '-',
@@ -391,55 +1637,626 @@ void list_directory_extend(int socket, const char *path) {
              (file_stat.st_mode & S_IWOTH) ? 'w' : '-',
              (file_stat.st_mode & S_IXOTH) ? 'x' : '-');
 
-    // send(socket, buffer, strlen(buffer), 0);
-    tm_info = localtime(&file_stat.st_mtime);
-    strftime(time_buffer, sizeof(time_buffer), "%y-%m-%d %H:%M", tm_info);
+    // the time is printed with minute resolution, reuse it when it matches
+    if (file_stat.st_mtime / 60 != time_minute) {
+      time_minute = file_stat.st_mtime / 60;
+      localtime_r(&file_stat.st_mtime, &tm_info);
+      strftime(time_buffer, sizeof(time_buffer), "%y-%m-%d %H:%M", &tm_info);
+    }
     float size = file_stat.st_size / 1024.0;
 
-    snprintf(buffer, BUFFER_SIZE, "%s %s %s \t%s\t%1.fK\t%s\r\n", permissions,
-             pw ? pw->pw_name : "", gr ? gr->gr_name : "", time_buffer, size,
-             entry->d_name);
-
-    send(socket, buffer, strlen(buffer), 0);
+    char *line = list_writer_reserve(writer, BUFFER_SIZE);
+    if (line == NULL) {
+      closedir(dir);
+      return false;
+    }
+    int len = snprintf(line, BUFFER_SIZE, "%s %s %s \t%s\t%1.fK\t%s\r\n",
+                       permissions, lookup_name(false, file_stat.st_uid),
+                       lookup_name(true, file_stat.st_gid), time_buffer, size,
+                       entry->d_name);
+    writer->used += len < BUFFER_SIZE ? len : BUFFER_SIZE - 1;
+    entries++;
   }
 
   closedir(dir);
+  bool ok = list_writer_flush(writer);
+
+  double seconds = elapsed_seconds(&start);
+  log_write(LOG_LEVEL_INFO, -1, seconds, LOG_LISTED, entries,
+            seconds > 0 ? entries / seconds : 0.0);
+  return ok;
 }
 
-void send_file(int socket, const char *filename) {
-  int file_fd;
-  char buffer[BUFFER_SIZE];
-  ssize_t bytes_read;
+// Returns room for len bytes in the current chunk, moving on to the next one
+// (and writing all of them out when none is left). NULL if the send failed.
+char *list_writer_reserve(ListWriter *writer, size_t len) {
+  if (writer->used + len > LIST_CHUNK) {
+    writer->iov[writer->count].iov_base = writer->chunks[writer->count];
+    writer->iov[writer->count].iov_len = writer->used;
+    writer->count++;
+    writer->used = 0;
+    if (writer->count == LIST_IOV && !list_writer_flush(writer))
+      return NULL;
+  }
+  return writer->chunks[writer->count] + writer->used;
+}
 
-  printf("- sending file %s\n", filename);
-  file_fd = open(filename, O_RDONLY);
-  if (file_fd == -1) {
-    perror(ERR_OPEN_FILE);
-    return;
+bool list_writer_flush(ListWriter *writer) {
+  if (writer->used > 0) {
+    writer->iov[writer->count].iov_base = writer->chunks[writer->count];
+    writer->iov[writer->count].iov_len = writer->used;
+    writer->count++;
+    writer->used = 0;
+  }
+
+  struct iovec *iov = writer->iov;
+  int count = writer->count;
+  writer->count = 0;
+
+  if (writer->capture != NULL) {
+    for (int i = 0; i < count; i++) {
+      if (writer->capture_len + iov[i].iov_len > writer->capture_size) {
+        size_t size = writer->capture_size * 2;
+        char *grown = size <= LIST_CACHE_MAX ? realloc(writer->capture, size)
+                                             : NULL;
+        if (grown == NULL) {
+          // too big to be worth caching
+          free(writer->capture);
+          writer->capture = NULL;
+          break;
+        }
+        writer->capture = grown;
+        writer->capture_size = size;
+      }
+      memcpy(writer->capture + writer->capture_len, iov[i].iov_base,
+             iov[i].iov_len);
+      writer->capture_len += iov[i].iov_len;
+    }
   }
 
-  while ((bytes_read = read(file_fd, buffer, BUFFER_SIZE)) > 0) {
-    send(socket, buffer, bytes_read, 0);
+  if (writer->filter != NULL) {
+    for (int i = 0; i < count; i++)
+      if (!filter_write(writer->filter, iov[i].iov_base, iov[i].iov_len,
+                        Z_NO_FLUSH))
+        return false;
+    return true;
   }
 
-  close(file_fd);
+  while (count > 0) {
+    ssize_t sent = writev(writer->socket, iov, count);
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      log_perror(ERR_SEND_FAIL);
+      return false;
+    }
+    // skip what went out, a short writev can stop in the middle of a chunk
+    while (count > 0 && (size_t)sent >= iov->iov_len) {
+      sent -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + sent;
+      iov->iov_len -= sent;
+    }
+  }
+  return true;
 }
 
-void change_directory(ClientConnection *conn, const char *path) {
-  char new_path[MAX_PATH];
-  int result;
+const char *lookup_name(bool group, unsigned int id) {
+  NameCacheEntry *entry = &(group ? name_cache.groups
+                                  : name_cache.users)[id % NAME_CACHE_SIZE];
+  static __thread char names[2][32];
+  char *name = names[group];
+
+  pthread_mutex_lock(&name_cache.lock);
+  if (entry->valid && entry->id == id) {
+    strcpy(name, entry->name);
+    pthread_mutex_unlock(&name_cache.lock);
+    return name;
+  }
+  pthread_mutex_unlock(&name_cache.lock);
 
-  if (path[0] == '/') {
-    // Absolute path
-    result = snprintf(new_path, MAX_PATH, "%s", path);
-    // strncpy(new_path, path, MAX_PATH);
+  char buffer[BUFFER_SIZE];
+  name[0] = '\0';
+  if (group) {
+    struct group gr, *result;
+    if (getgrgid_r(id, &gr, buffer, sizeof(buffer), &result) == 0 && result)
+      snprintf(name, sizeof(names[0]), "%s", gr.gr_name);
   } else {
-    // Relative path
-    result = snprintf(new_path, MAX_PATH, "%s/%s", conn->current_dir, path);
+    struct passwd pw, *result;
+    if (getpwuid_r(id, &pw, buffer, sizeof(buffer), &result) == 0 && result)
+      snprintf(name, sizeof(names[0]), "%s", pw.pw_name);
   }
 
-  if (result >= MAX_PATH) {
-    send_response(conn->control_socket, MSG_CWD_FAIL);
+  pthread_mutex_lock(&name_cache.lock);
+  entry->valid = true;
+  entry->id = id;
+  strcpy(entry->name, name);
+  pthread_mutex_unlock(&name_cache.lock);
+  return name;
+}
+
+void listing_cache_init() {
+  listing_cache.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (listing_cache.inotify_fd < 0)
+    log_perror("inotify_init1"); // listings just won't be cached
+}
+
+ListingEntry *listing_cache_get(const char *path, bool extended) {
+  pthread_mutex_lock(&listing_cache.lock);
+  for (ListingEntry **link = &listing_cache.head; *link;
+       link = &(*link)->next) {
+    ListingEntry *entry = *link;
+    if (entry->extended == extended && strcmp(entry->path, path) == 0) {
+      // move to the front
+      *link = entry->next;
+      entry->next = listing_cache.head;
+      listing_cache.head = entry;
+      entry->refs++;
+      pthread_mutex_unlock(&listing_cache.lock);
+      return entry;
+    }
+  }
+  pthread_mutex_unlock(&listing_cache.lock);
+  return NULL;
+}
+
+void listing_cache_release(ListingEntry *entry) {
+  pthread_mutex_lock(&listing_cache.lock);
+  bool done = --entry->refs == 0 && entry->stale;
+  pthread_mutex_unlock(&listing_cache.lock);
+  if (done) {
+    free(entry->data);
+    free(entry);
+  }
+}
+
+// Takes ownership of data and the reference to wd. Nothing is cached if the
+// directory changed since epoch was read, the listing may already be out of
+// date.
+void listing_cache_put(const char *path, bool extended, int wd,
+                       unsigned long epoch, char *data, size_t len) {
+  ListingEntry *entry = calloc(1, sizeof(ListingEntry));
+  if (entry == NULL) {
+    free(data);
+    pthread_mutex_lock(&listing_cache.lock);
+    listing_watch_release(wd);
+    pthread_mutex_unlock(&listing_cache.lock);
+    return;
+  }
+  snprintf(entry->path, sizeof(entry->path), "%s", path);
+  entry->extended = extended;
+  entry->wd = wd;
+  entry->data = data;
+  entry->len = len;
+
+  pthread_mutex_lock(&listing_cache.lock);
+  bool cached = false;
+  for (ListingEntry *other = listing_cache.head; other; other = other->next)
+    cached = cached || (other->extended == extended &&
+                        strcmp(other->path, path) == 0);
+  if (epoch != listing_cache.epoch || cached) {
+    listing_watch_release(wd);
+    pthread_mutex_unlock(&listing_cache.lock);
+    free(data);
+    free(entry);
+    return;
+  }
+
+  entry->next = listing_cache.head;
+  listing_cache.head = entry;
+  if (++listing_cache.count > LIST_CACHE_ENTRIES) {
+    ListingEntry **link = &listing_cache.head;
+    while ((*link)->next)
+      link = &(*link)->next;
+    listing_cache_unlink(link);
+  }
+  pthread_mutex_unlock(&listing_cache.lock);
+}
+
+// Called from the event loop when the inotify fd is readable.
+void listing_cache_events() {
+  char buffer[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t len;
+
+  while ((len = read(listing_cache.inotify_fd, buffer, sizeof(buffer))) > 0) {
+    pthread_mutex_lock(&listing_cache.lock);
+    for (char *ptr = buffer; ptr < buffer + len;) {
+      struct inotify_event *event = (struct inotify_event *)ptr;
+      ptr += sizeof(struct inotify_event) + event->len;
+
+      // sent once a watch is gone, its entries were dropped already
+      if (event->mask & IN_IGNORED)
+        continue;
+
+      bool overflow = event->mask & IN_Q_OVERFLOW;
+      ListingEntry **link = &listing_cache.head;
+      while (*link) {
+        if (overflow || (*link)->wd == event->wd)
+          listing_cache_unlink(link);
+        else
+          link = &(*link)->next;
+      }
+      listing_cache.epoch++;
+    }
+    pthread_mutex_unlock(&listing_cache.lock);
+  }
+}
+
+// Removes *link from the list, the lock must be held.
+void listing_cache_unlink(ListingEntry **link) {
+  ListingEntry *entry = *link;
+  *link = entry->next;
+  listing_cache.count--;
+  listing_watch_release(entry->wd);
+  entry->stale = true;
+  if (entry->refs == 0) {
+    free(entry->data);
+    free(entry);
+  }
+}
+
+// Watches path, or takes another reference to its watch (the kernel has
+// one per directory), -1 on error. The lock must be held, so a release
+// can't remove the watch between the two.
+int listing_watch_add(const char *path) {
+  int wd = inotify_add_watch(listing_cache.inotify_fd, path,
+                             IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB |
+                                 IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF |
+                                 IN_MOVE_SELF);
+  if (wd < 0)
+    return -1;
+
+  ListingWatch *watch = listing_cache.watches;
+  while (watch != NULL && watch->wd != wd)
+    watch = watch->next;
+  if (watch == NULL) {
+    if ((watch = malloc(sizeof(ListingWatch))) == NULL) {
+      inotify_rm_watch(listing_cache.inotify_fd, wd);
+      return -1;
+    }
+    watch->wd = wd;
+    watch->refs = 0;
+    watch->next = listing_cache.watches;
+    listing_cache.watches = watch;
+  }
+  watch->refs++;
+  return wd;
+}
+
+// The lock must be held
+void listing_watch_release(int wd) {
+  for (ListingWatch **link = &listing_cache.watches; *link;
+       link = &(*link)->next) {
+    ListingWatch *watch = *link;
+    if (watch->wd != wd)
+      continue;
+    if (--watch->refs == 0) {
+      // fails harmlessly when the directory is gone with its watch
+      inotify_rm_watch(listing_cache.inotify_fd, wd);
+      *link = watch->next;
+      free(watch);
+    }
+    return;
+  }
+}
+
+double elapsed_seconds(struct timespec *start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+bool send_all(int socket, const char *buffer, size_t len) {
+  while (len > 0) {
+    ssize_t sent =
+        send(socket, buffer, throttle_quantum(socket, len), MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    throttle_charge(socket, sent);
+    buffer += sent;
+    len -= sent;
+  }
+  return true;
+}
+
+// Every data path moves at most throttle_quantum() bytes at a time and then
+// pays for what it moved with throttle_charge(). Both only apply to the
+// data connection of a capped transfer, so replies on the control
+// connection are never held back.
+size_t throttle_quantum(int socket, size_t want) {
+  if (throttled == NULL || socket != throttled->transfer_socket)
+    return want;
+  return rate_quantum(&throttled->rate, want);
+}
+
+void throttle_charge(int socket, size_t bytes) {
+  if (throttled != NULL && socket == throttled->transfer_socket)
+    rate_wait(&throttled->rate, bytes);
+}
+
+// Regular files go through sendfile() so the data never leaves the kernel,
+// anything else (pipes, devices) is spliced through a pipe. The transfer
+// starts at offset, as set by REST.
+bool send_file(int socket, const char *filename, off_t offset,
+               DataFilter *filter) {
+  int file_fd;
+
+  log_debug(LOG_SENDING_FILE, filename);
+  bool ok;
+  if (send_cached_file(socket, filename, offset, filter, &ok))
+    return ok;
+
+  file_fd = open(filename, O_RDONLY);
+  if (file_fd == -1) {
+    log_perror(ERR_OPEN_FILE);
+    return false;
+  }
+
+  ok = send_open_file(socket, file_fd, offset, filter);
+  close(file_fd);
+  return ok;
+}
+
+bool send_open_file(int socket, int file_fd, off_t offset,
+                    DataFilter *filter) {
+  struct stat file_stat;
+
+  if (fstat(file_fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode)) {
+    if (offset != 0 && lseek(file_fd, offset, SEEK_SET) != offset)
+      return false;
+    return filter != NULL ? filter_file(filter, file_fd, 0, -1) != -1
+                          : send_file_splice(socket, file_fd);
+  }
+
+  if (filter != NULL)
+    return filter_file(filter, file_fd, offset, file_stat.st_size) != -1;
+  return send_file_range(socket, file_fd, offset, file_stat.st_size) != -1;
+}
+
+// sendfile() from offset up to end. Returns where it stopped, before end
+// if the file was truncated meanwhile, or -1 on error.
+off_t send_file_range(int socket, int file_fd, off_t offset, off_t end) {
+  while (offset < end) {
+    off_t remaining = end - offset;
+    ssize_t sent = sendfile(
+        socket, file_fd, &offset,
+        throttle_quantum(socket, remaining > SENDFILE_CHUNK ? SENDFILE_CHUNK
+                                                            : remaining));
+    if (sent < 0) {
+      if (errno == EINTR)
+        continue;
+      log_perror(ERR_SEND_FAIL);
+      return -1;
+    }
+    if (sent == 0) // file truncated while sending
+      break;
+    throttle_charge(socket, sent);
+  }
+  return offset;
+}
+
+// Opens a file and has the kernel start reading it into the page cache in
+// the background, so it is ready by the time it gets sent.
+int prefetch_file(const char *filename) {
+  int file_fd = open(filename, O_RDONLY);
+  if (file_fd != -1)
+    posix_fadvise(file_fd, 0, 0, POSIX_FADV_WILLNEED);
+  return file_fd;
+}
+
+// Small regular files are served from the file cache. Returns false when
+// the file isn't cacheable and has to be sent from disk.
+bool send_cached_file(int socket, const char *filename, off_t offset,
+                      DataFilter *filter, bool *ok) {
+  struct stat file_stat;
+
+  if (stat(filename, &file_stat) == -1 || !S_ISREG(file_stat.st_mode) ||
+      file_stat.st_size == 0 || file_stat.st_size > FILE_CACHE_MAX_FILE)
+    return false;
+
+  FileEntry *entry = file_cache_get(filename, &file_stat);
+  if (entry == NULL && (entry = file_cache_load(filename, &file_stat)) == NULL)
+    return false;
+
+  if (offset >= entry->size)
+    *ok = true;
+  else if (filter != NULL)
+    *ok = filter_write(filter, entry->data + offset, entry->size - offset,
+                       Z_NO_FLUSH);
+  else if (!(*ok = send_all(socket, entry->data + offset,
+                            entry->size - offset)))
+    log_perror(ERR_SEND_FAIL);
+  file_cache_release(entry);
+  return true;
+}
+
+FileEntry *file_cache_get(const char *filename, struct stat *file_stat) {
+  pthread_mutex_lock(&file_cache.lock);
+  for (FileEntry **link = &file_cache.head; *link; link = &(*link)->next) {
+    FileEntry *entry = *link;
+    if (strcmp(entry->path, filename) != 0)
+      continue;
+
+    if (entry->size != file_stat->st_size ||
+        entry->mtime.tv_sec != file_stat->st_mtim.tv_sec ||
+        entry->mtime.tv_nsec != file_stat->st_mtim.tv_nsec) {
+      file_cache_unlink(link); // the file changed
+      break;
+    }
+
+    *link = entry->next;
+    entry->next = file_cache.head;
+    file_cache.head = entry;
+    entry->refs++;
+    file_cache.hits++;
+    log_debug(LOG_FILE_CACHE, "hit", file_cache.hits, file_cache.misses);
+    pthread_mutex_unlock(&file_cache.lock);
+    return entry;
+  }
+  file_cache.misses++;
+  log_debug(LOG_FILE_CACHE, "miss", file_cache.hits, file_cache.misses);
+  pthread_mutex_unlock(&file_cache.lock);
+  return NULL;
+}
+
+// The contents are copied into an anonymous mapping rather than mapping the
+// file itself, a client truncating the file would otherwise make the
+// senders fault with SIGBUS. Returns the new entry with a reference held.
+FileEntry *file_cache_load(const char *filename, struct stat *file_stat) {
+  int file_fd = open(filename, O_RDONLY);
+  if (file_fd == -1)
+    return NULL;
+
+  FileEntry *entry = calloc(1, sizeof(FileEntry));
+  char *data = mmap(NULL, file_stat->st_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (entry == NULL || data == MAP_FAILED) {
+    free(entry);
+    if (data != MAP_FAILED)
+      munmap(data, file_stat->st_size);
+    close(file_fd);
+    return NULL;
+  }
+
+  off_t loaded = 0;
+  while (loaded < file_stat->st_size) {
+    ssize_t bytes_read =
+        pread(file_fd, data + loaded, file_stat->st_size - loaded, loaded);
+    if (bytes_read <= 0) {
+      if (bytes_read < 0 && errno == EINTR)
+        continue;
+      break;
+    }
+    loaded += bytes_read;
+  }
+  close(file_fd);
+
+  if (loaded != file_stat->st_size) { // changed under us, use the disk path
+    munmap(data, file_stat->st_size);
+    free(entry);
+    return NULL;
+  }
+  mprotect(data, file_stat->st_size, PROT_READ);
+
+  snprintf(entry->path, sizeof(entry->path), "%s", filename);
+  entry->mtime = file_stat->st_mtim;
+  entry->size = file_stat->st_size;
+  entry->data = data;
+  entry->refs = 1;
+
+  pthread_mutex_lock(&file_cache.lock);
+  entry->next = file_cache.head;
+  file_cache.head = entry;
+  file_cache.bytes += entry->size;
+  while (file_cache.bytes > FILE_CACHE_SIZE) {
+    FileEntry **link = &file_cache.head;
+    while ((*link)->next)
+      link = &(*link)->next;
+    file_cache_unlink(link);
+  }
+  pthread_mutex_unlock(&file_cache.lock);
+  return entry;
+}
+
+void file_cache_release(FileEntry *entry) {
+  pthread_mutex_lock(&file_cache.lock);
+  bool done = --entry->refs == 0 && entry->stale;
+  pthread_mutex_unlock(&file_cache.lock);
+  if (done) {
+    munmap(entry->data, entry->size);
+    free(entry);
+  }
+}
+
+// Removes *link from the list, the lock must be held.
+void file_cache_unlink(FileEntry **link) {
+  FileEntry *entry = *link;
+  *link = entry->next;
+  file_cache.bytes -= entry->size;
+  entry->stale = true;
+  if (entry->refs == 0) {
+    munmap(entry->data, entry->size);
+    free(entry);
+  }
+}
+
+bool send_file_splice(int socket, int file_fd) {
+  int pipe_fd[2];
+  bool ok = true;
+
+  if (!create_pipe(pipe_fd))
+    return false;
+
+  while (1) {
+    ssize_t in = splice(file_fd, NULL, pipe_fd[1], NULL,
+                        throttle_quantum(socket, PIPE_CHUNK),
+                        SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (in < 0 && errno == EINTR)
+      continue;
+    if (in < 0 && errno == EINVAL) {
+      // the source doesn't support splice, copy through user space
+      char buffer[PIPE_CHUNK];
+      ssize_t bytes_read;
+      while ((bytes_read = read(file_fd, buffer, sizeof(buffer))) > 0) {
+        if (!send_all(socket, buffer, bytes_read)) {
+          ok = false;
+          break;
+        }
+      }
+      ok = ok && bytes_read == 0;
+      break;
+    }
+    if (in <= 0) {
+      ok = in == 0;
+      break;
+    }
+
+    // drain the pipe completely, splice may move less than asked
+    while (in > 0) {
+      ssize_t out = splice(pipe_fd[0], NULL, socket, NULL, in,
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (out < 0) {
+        if (errno == EINTR)
+          continue;
+        ok = false;
+        break;
+      }
+      throttle_charge(socket, out);
+      in -= out;
+    }
+    if (!ok)
+      break;
+  }
+
+  if (!ok)
+    log_perror(ERR_SEND_FAIL);
+  close(pipe_fd[0]);
+  close(pipe_fd[1]);
+  return ok;
+}
+
+void change_directory(ClientConnection *conn, const char *path) {
+  char new_path[MAX_PATH];
+  int result;
+
+  if (path[0] == '/') {
+    // Absolute path
+    result = snprintf(new_path, MAX_PATH, "%s", path);
+    // strncpy(new_path, path, MAX_PATH);
+  } else {
+    // Relative path
+    result = snprintf(new_path, MAX_PATH, "%s/%s", conn->current_dir, path);
+  }
+
+  if (result >= MAX_PATH) {
+    send_response(conn->control_socket, MSG_CWD_FAIL);
     return;
   }
 
@@ -450,32 +2267,998 @@ void change_directory(ClientConnection *conn, const char *path) {
     return;
   }
 
-  // Check if the directory exists and is accessible
-  if (chdir(resolved_path) == 0) {
-    strncpy(conn->current_dir, resolved_path, MAX_PATH);
+  // Check if the directory exists and is accessible. chdir() is process wide
+  // and sessions run concurrently, so each one only tracks its own path.
+  struct stat dir_stat;
+  if (stat(resolved_path, &dir_stat) == 0 && S_ISDIR(dir_stat.st_mode) &&
+      access(resolved_path, R_OK | X_OK) == 0) {
+    strncpy(conn->current_dir, resolved_path, sizeof(conn->current_dir) - 1);
     send_response(conn->control_socket, MSG_CWD_OK);
   } else {
     send_response(conn->control_socket, MSG_CWD_FAIL);
   }
 }
 
-void receive_file(int socket, const char *filename) {
+bool create_pipe(int pipe_fd[2]) {
+  if (pipe(pipe_fd) == -1) {
+    log_perror("pipe");
+    return false;
+  }
+  // a bigger pipe means fewer splice round trips, the default is 64K
+  fcntl(pipe_fd[1], F_SETPIPE_SZ, RECV_CHUNK);
+  return true;
+}
+
+bool write_all(int fd, const char *buffer, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, buffer, len);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    buffer += written;
+    len -= written;
+  }
+  return true;
+}
+
+// A missing <dir>.tar or <dir>.zip whose <dir> exists is a virtual archive
+// of that directory. Returns true and the directory if path is one.
+bool archive_source(const char *path, char *dir_path, bool *zip) {
+  struct stat file_stat;
+  size_t len = strlen(path);
+
+  if (len < 5 || len >= MAX_PATH)
+    return false;
+  if (strcmp(path + len - 4, ".tar") == 0)
+    *zip = false;
+  else if (strcmp(path + len - 4, ".zip") == 0)
+    *zip = true;
+  else
+    return false;
+
+  if (lstat(path, &file_stat) == 0 || errno != ENOENT)
+    return false;
+  memcpy(dir_path, path, len - 4);
+  dir_path[len - 4] = '\0';
+  return stat(dir_path, &file_stat) == 0 && S_ISDIR(file_stat.st_mode);
+}
+
+// Streams a tar or zip of dir_path, members named <dir>/..., while walking
+// the tree: nothing is buffered but the zip central directory. Tar members
+// are sent with sendfile() and the socket is corked so headers, bodies and
+// padding leave in full segments. Only directories and regular files are
+// archived.
+bool send_archive(int socket, const char *dir_path, bool zip,
+                  DataFilter *filter) {
+  ArchiveWriter writer = {.socket = socket, .filter = filter, .zip = zip};
+  int cork = 1;
+  bool ok = false;
+
+  log_debug(LOG_SENDING_ARCHIVE, zip ? "zip" : "tar", dir_path);
+  const char *base = strrchr(dir_path, '/');
+  base = base != NULL && base[1] != '\0' ? base + 1 : dir_path;
+  size_t name_len = snprintf(writer.name, MAX_PATH, "%s/", base);
+
+  int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+  if (dir_fd == -1) {
+    log_perror(ERR_OPEN_DIR);
+    return false;
+  }
+
+  if (zip) {
+    writer.buffer = malloc(2 * PIPE_CHUNK);
+    if (writer.buffer == NULL ||
+        deflateInit2(&writer.stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15,
+                     8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      log_error(ERR_ALLOC_FAIL);
+      free(writer.buffer);
+      close(dir_fd);
+      return false;
+    }
+  }
+
+  setsockopt(socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+  struct stat dir_stat;
+  if (fstat(dir_fd, &dir_stat) == 0)
+    ok = zip ? zip_entry(&writer, -1, &dir_stat)
+             : tar_entry(&writer, -1, &dir_stat);
+  if (!ok)
+    close(dir_fd);
+  else if (archive_directory(&writer, dir_fd, name_len)) {
+    if (zip) {
+      ok = zip_finish(&writer);
+    } else {
+      char end[2 * TAR_BLOCK] = {0};
+      ok = archive_write(&writer, end, sizeof(end));
+    }
+  } else
+    ok = false;
+  cork = 0;
+  setsockopt(socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+
+  if (zip) {
+    deflateEnd(&writer.stream);
+    free(writer.buffer);
+    for (size_t i = 0; i < writer.count; i++)
+      free(writer.entries[i].name);
+    free(writer.entries);
+  }
+  if (ok)
+    log_write(LOG_LEVEL_INFO, writer.written, -1, LOG_SENT_ARCHIVE, dir_path,
+              writer.count);
+  return ok;
+}
+
+// Adds the contents of dir_fd, writer->name holds the directory's path in
+// the archive (name_len chars, ending with a slash). Takes ownership of
+// dir_fd.
+bool archive_directory(ArchiveWriter *writer, int dir_fd, size_t name_len) {
+  DIR *dir = fdopendir(dir_fd);
+  struct dirent *entry;
+  bool ok = true;
+
+  if (dir == NULL) {
+    log_perror(ERR_OPEN_DIR);
+    close(dir_fd);
+    return false;
+  }
+
+  while (ok && (entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+      continue;
+    if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_DIR &&
+        entry->d_type != DT_REG)
+      continue;
+
+    size_t len = strlen(entry->d_name);
+    if (name_len + len + 2 > MAX_PATH)
+      continue;
+    memcpy(writer->name + name_len, entry->d_name, len + 1);
+
+    // O_NONBLOCK so a fifo of unknown type can't hang the walk
+    int fd = openat(dir_fd, entry->d_name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+    struct stat file_stat;
+    if (fd == -1 || fstat(fd, &file_stat) == -1) {
+      // unreadable entries are left out rather than failing the archive
+      if (fd != -1)
+        close(fd);
+      continue;
+    }
+
+    if (S_ISDIR(file_stat.st_mode)) {
+      memcpy(writer->name + name_len + len, "/", 2);
+      ok = writer->zip ? zip_entry(writer, -1, &file_stat)
+                       : tar_entry(writer, -1, &file_stat);
+      if (ok)
+        ok = archive_directory(writer, fd, name_len + len + 1);
+      else
+        close(fd);
+      continue;
+    }
+    if (S_ISREG(file_stat.st_mode))
+      ok = writer->zip ? zip_entry(writer, fd, &file_stat)
+                       : tar_entry(writer, fd, &file_stat);
+    close(fd);
+  }
+
+  closedir(dir);
+  return ok;
+}
+
+bool archive_write(ArchiveWriter *writer, const void *data, size_t len) {
+  if (writer->filter != NULL) {
+    if (!filter_write(writer->filter, data, len, Z_NO_FLUSH))
+      return false;
+  } else if (!send_all(writer->socket, data, len)) {
+    log_perror(ERR_SEND_FAIL);
+    return false;
+  }
+  writer->written += len;
+  return true;
+}
+
+// Zero fill to the next tar block
+bool archive_pad(ArchiveWriter *writer) {
+  static const char zeros[TAR_BLOCK];
+  size_t used = writer->written % TAR_BLOCK;
+  return used == 0 || archive_write(writer, zeros, TAR_BLOCK - used);
+}
+
+// A directory (file_fd -1) or regular file named writer->name. The body
+// size is fixed by the header, a file that shrinks meanwhile is zero
+// filled and the rest of one that grows is left out.
+bool tar_entry(ArchiveWriter *writer, int file_fd, struct stat *file_stat) {
+  writer->count++;
+  if (file_fd == -1)
+    return tar_header(writer, writer->name, '5', 0, file_stat);
+
+  off_t size = file_stat->st_size;
+  if (!tar_header(writer, writer->name, '0', size, file_stat))
+    return false;
+
+  off_t sent;
+  if (writer->filter != NULL) {
+    filter_level(writer->filter, writer->name);
+    sent = filter_file(writer->filter, file_fd, 0, size);
+  } else
+    sent = send_file_range(writer->socket, file_fd, 0, size);
+  if (sent == -1)
+    return false;
+  writer->written += sent;
+  while (sent < size) {
+    static const char zeros[TAR_BLOCK];
+    size_t len = size - sent < TAR_BLOCK ? size - sent : TAR_BLOCK;
+    if (!archive_write(writer, zeros, len))
+      return false;
+    sent += len;
+  }
+  return archive_pad(writer);
+}
+
+// Names that don't fit the header go first in a GNU long name record
+bool tar_header(ArchiveWriter *writer, const char *name, char type,
+                off_t size, struct stat *file_stat) {
+  TarHeader header;
+  size_t name_len = strlen(name);
+
+  if (name_len > sizeof(header.name) &&
+      (!tar_header(writer, "././@LongLink", 'L', name_len + 1, file_stat) ||
+       !archive_write(writer, name, name_len + 1) || !archive_pad(writer)))
+    return false;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.name, name,
+         name_len < sizeof(header.name) ? name_len : sizeof(header.name));
+  tar_number(header.mode, sizeof(header.mode), file_stat->st_mode & 07777);
+  tar_number(header.uid, sizeof(header.uid), file_stat->st_uid);
+  tar_number(header.gid, sizeof(header.gid), file_stat->st_gid);
+  tar_number(header.size, sizeof(header.size), size);
+  tar_number(header.mtime, sizeof(header.mtime), file_stat->st_mtime);
+  header.type = type;
+  memcpy(header.magic, "ustar  ", sizeof(header.magic));
+  snprintf(header.uname, sizeof(header.uname), "%s",
+           lookup_name(false, file_stat->st_uid));
+  snprintf(header.gname, sizeof(header.gname), "%s",
+           lookup_name(true, file_stat->st_gid));
+
+  unsigned int checksum = 0;
+  memset(header.checksum, ' ', sizeof(header.checksum));
+  for (size_t i = 0; i < sizeof(header); i++)
+    checksum += ((unsigned char *)&header)[i];
+  snprintf(header.checksum, sizeof(header.checksum), "%06o", checksum);
+
+  return archive_write(writer, &header, sizeof(header));
+}
+
+// Zero padded octal, or base-256 (GNU) for values too large for the field
+void tar_number(char *field, size_t width, unsigned long long value) {
+  if (value < 1ULL << (3 * (width - 1))) {
+    snprintf(field, width, "%0*llo", (int)width - 1, value);
+    return;
+  }
+  for (size_t i = width - 1; i > 0; i--, value >>= 8)
+    field[i] = value & 0xff;
+  field[0] = (char)0x80;
+}
+
+// A directory (file_fd -1) or regular file named writer->name. Files are
+// deflated as they are read, so their crc and sizes follow the data in a
+// descriptor and are repeated in the central directory.
+bool zip_entry(ArchiveWriter *writer, int file_fd, struct stat *file_stat) {
+  unsigned char header[30];
+  struct tm tm_info;
+
+  if (!zip_fits(writer, file_stat->st_size))
+    return false;
+  if (writer->count == writer->capacity) {
+    size_t capacity = writer->capacity ? 2 * writer->capacity : 64;
+    ZipEntry *entries =
+        realloc(writer->entries, capacity * sizeof(ZipEntry));
+    if (entries == NULL) {
+      log_error(ERR_ALLOC_FAIL);
+      return false;
+    }
+    writer->entries = entries;
+    writer->capacity = capacity;
+  }
+
+  ZipEntry *entry = &writer->entries[writer->count];
+  memset(entry, 0, sizeof(*entry));
+  entry->name = strdup(writer->name);
+  if (entry->name == NULL) {
+    log_error(ERR_ALLOC_FAIL);
+    return false;
+  }
+  writer->count++;
+  entry->method = file_fd == -1 ? 0 : Z_DEFLATED;
+  entry->offset = writer->written;
+  entry->mode = file_stat->st_mode;
+  localtime_r(&file_stat->st_mtime, &tm_info);
+  if (tm_info.tm_year < 80)
+    tm_info = (struct tm){.tm_year = 80, .tm_mday = 1};
+  entry->dos_time = tm_info.tm_hour << 11 | tm_info.tm_min << 5 |
+                    tm_info.tm_sec / 2;
+  entry->dos_date = (tm_info.tm_year - 80) << 9 | (tm_info.tm_mon + 1) << 5 |
+                    tm_info.tm_mday;
+
+  size_t name_len = strlen(entry->name);
+  unsigned char *p = put32(header, 0x04034b50);
+  p = put16(p, 20);                       // version needed
+  p = put16(p, file_fd == -1 ? 0 : 0x8);  // sizes in data descriptor
+  p = put16(p, entry->method);
+  p = put16(p, entry->dos_time);
+  p = put16(p, entry->dos_date);
+  memset(p, 0, 12);                       // crc and sizes, all unknown yet
+  p = put16(p + 12, name_len);
+  put16(p, 0);                            // extra field length
+  if (!archive_write(writer, header, sizeof(header)) ||
+      !archive_write(writer, entry->name, name_len))
+    return false;
+
+  return file_fd == -1 || zip_deflate(writer, file_fd, entry);
+}
+
+bool zip_deflate(ArchiveWriter *writer, int file_fd, ZipEntry *entry) {
+  z_stream *stream = &writer->stream;
+  unsigned char *in = writer->buffer;
+  unsigned char *out = writer->buffer + PIPE_CHUNK;
+  off_t size = 0;
+  uLong crc = crc32(0, Z_NULL, 0);
+  int flush = Z_NO_FLUSH; // an interrupted read goes round again
+
+  deflateReset(stream);
+  do {
+    ssize_t got = read(file_fd, in, PIPE_CHUNK);
+    if (got < 0) {
+      if (errno == EINTR)
+        continue;
+      log_perror(ERR_OPEN_FILE);
+      return false;
+    }
+    size += got;
+    if (!zip_fits(writer, size))
+      return false;
+    crc = crc32(crc, in, got);
+    flush = got == 0 ? Z_FINISH : Z_NO_FLUSH;
+    stream->next_in = in;
+    stream->avail_in = got;
+    do {
+      stream->next_out = out;
+      stream->avail_out = PIPE_CHUNK;
+      deflate(stream, flush);
+      if (!archive_write(writer, out, PIPE_CHUNK - stream->avail_out))
+        return false;
+    } while (stream->avail_out == 0);
+  } while (flush != Z_FINISH);
+
+  unsigned char descriptor[16];
+  entry->crc = crc;
+  entry->compressed_size = stream->total_out;
+  entry->size = size;
+  unsigned char *p = put32(descriptor, 0x08074b50);
+  p = put32(p, entry->crc);
+  p = put32(p, entry->compressed_size);
+  put32(p, entry->size);
+  return archive_write(writer, descriptor, sizeof(descriptor));
+}
+
+bool zip_finish(ArchiveWriter *writer) {
+  unsigned char header[46];
+  off_t start = writer->written;
+
+  for (size_t i = 0; i < writer->count; i++) {
+    ZipEntry *entry = &writer->entries[i];
+    size_t name_len = strlen(entry->name);
+    unsigned char *p = put32(header, 0x02014b50);
+    p = put16(p, 3 << 8 | 20); // made by unix, so the mode below is used
+    p = put16(p, 20);
+    p = put16(p, entry->method == 0 ? 0 : 0x8);
+    p = put16(p, entry->method);
+    p = put16(p, entry->dos_time);
+    p = put16(p, entry->dos_date);
+    p = put32(p, entry->crc);
+    p = put32(p, entry->compressed_size);
+    p = put32(p, entry->size);
+    p = put16(p, name_len);
+    memset(p, 0, 8); // extra, comment, disk, internal attributes
+    p = put32(p + 8, (uint32_t)entry->mode << 16 |
+                         (S_ISDIR(entry->mode) ? 0x10 : 0));
+    put32(p, entry->offset);
+    if (!archive_write(writer, header, sizeof(header)) ||
+        !archive_write(writer, entry->name, name_len))
+      return false;
+  }
+
+  unsigned char end[22];
+  if (!zip_fits(writer, 0))
+    return false;
+  unsigned char *p = put32(end, 0x06054b50);
+  p = put32(p, 0); // disk numbers
+  p = put16(p, writer->count);
+  p = put16(p, writer->count);
+  p = put32(p, writer->written - start);
+  p = put32(p, start);
+  put16(p, 0); // comment length
+  return archive_write(writer, end, sizeof(end));
+}
+
+// Without Zip64, members, sizes and offsets are limited to 16 and 32 bits
+bool zip_fits(ArchiveWriter *writer, off_t size) {
+  if (writer->count < ZIP_MAX_ENTRIES && size <= UINT32_MAX &&
+      writer->written <= UINT32_MAX)
+    return true;
+  log_error(ERR_ZIP_LIMIT);
+  return false;
+}
+
+unsigned char *put16(unsigned char *p, uint16_t value) {
+  p[0] = value;
+  p[1] = value >> 8;
+  return p + 2;
+}
+
+unsigned char *put32(unsigned char *p, uint32_t value) {
+  p = put16(p, value);
+  return put16(p, value >> 16);
+}
+
+// Sets up the encoding of a transfer for the session's MODE and TYPE.
+// Listings are CRLF text already and only get deflated. *filter is left
+// NULL when nothing needs encoding. False, with a NULL filter, if zlib
+// couldn't be set up.
+bool filter_begin(ClientConnection *conn, int socket, const char *name,
+                  FilterKind kind, DataFilter **filter) {
+  bool ascii = conn->type_ascii && kind != FILTER_LISTING;
+
+  *filter = NULL;
+  if (!conn->mode_z && !ascii)
+    return true;
+
+  DataFilter *new_filter = malloc(sizeof(DataFilter));
+  if (new_filter == NULL) {
+    log_error(ERR_ALLOC_FAIL);
+    return false;
+  }
+  new_filter->socket = socket;
+  new_filter->upload = kind == FILTER_UPLOAD;
+  new_filter->deflate = conn->mode_z;
+  new_filter->ascii = ascii;
+  new_filter->pending_cr = false;
+  memset(&new_filter->stream, 0, sizeof(z_stream));
+  int result = Z_OK;
+  if (!conn->mode_z)
+    ;
+  else if (new_filter->upload)
+    result = inflateInit(&new_filter->stream);
+  else
+    result = deflateInit(&new_filter->stream, compressed_name(name)
+                                                  ? Z_NO_COMPRESSION
+                                                  : Z_DEFAULT_COMPRESSION);
+  if (result != Z_OK) {
+    log_error(ERR_ZLIB_FAIL, name);
+    free(new_filter);
+    return false;
+  }
+  *filter = new_filter;
+  return true;
+}
+
+// Ends the stream, ok tells whether the transfer went well so far. Returns
+// whether it still did, and frees the filter.
+bool filter_end(DataFilter *filter, const char *name, bool ok) {
+  if (filter == NULL)
+    return ok;
+
+  z_stream *stream = &filter->stream;
+  if (!filter->deflate) { // nothing buffered
+    free(filter);
+    return ok;
+  }
+
+  if (filter->upload) {
+    if (ok)
+      log_info(LOG_INFLATED, name, (unsigned long long)stream->total_in,
+               stream->total_out ? 100.0 * stream->total_in / stream->total_out
+                                 : 100.0);
+    inflateEnd(stream);
+    free(filter);
+    return ok;
+  }
+
+  ok = ok && filter_write(filter, NULL, 0, Z_FINISH);
+  if (ok) {
+    unsigned long long in = __atomic_add_fetch(&deflate_in, stream->total_in,
+                                               __ATOMIC_RELAXED);
+    unsigned long long out = __atomic_add_fetch(
+        &deflate_out, stream->total_out, __ATOMIC_RELAXED);
+    log_write(LOG_LEVEL_INFO, stream->total_in, -1, LOG_DEFLATED, name,
+              (unsigned long long)stream->total_out,
+              stream->total_in ? 100.0 * stream->total_out / stream->total_in
+                               : 100.0,
+              in ? 100.0 * out / in : 100.0);
+  }
+  deflateEnd(stream);
+  free(filter);
+  return ok;
+}
+
+// Encodes and sends len bytes, flush is passed on to deflate()
+bool filter_write(DataFilter *filter, const void *data, size_t len,
+                  int flush) {
+  if (!filter->ascii)
+    return filter_send(filter, data, len, flush);
+
+  const char *in = data;
+  do {
+    size_t chunk = len < PIPE_CHUNK ? len : PIPE_CHUNK;
+    size_t text_len = ascii_encode(in, chunk, filter->text);
+    in += chunk;
+    len -= chunk;
+    if (!filter_send(filter, filter->text, text_len,
+                     len == 0 ? flush : Z_NO_FLUSH))
+      return false;
+  } while (len > 0);
+  return true;
+}
+
+// Second stage of filter_write(), deflates if MODE Z
+bool filter_send(DataFilter *filter, const void *data, size_t len,
+                 int flush) {
+  z_stream *stream = &filter->stream;
+
+  if (!filter->deflate) {
+    if (len > 0 && !send_all(filter->socket, data, len)) {
+      log_perror(ERR_SEND_FAIL);
+      return false;
+    }
+    return true;
+  }
+
+  stream->next_in = (unsigned char *)data;
+  stream->avail_in = len;
+  do {
+    stream->next_out = filter->out;
+    stream->avail_out = PIPE_CHUNK;
+    deflate(stream, flush);
+    size_t ready = PIPE_CHUNK - stream->avail_out;
+    if (ready > 0 && !send_all(filter->socket, (char *)filter->out, ready)) {
+      log_perror(ERR_SEND_FAIL);
+      return false;
+    }
+  } while (stream->avail_out == 0);
+  return true;
+}
+
+// Deflates file_fd from offset up to end, or to EOF reading sequentially
+// when end is -1. Returns where it stopped like send_file_range().
+off_t filter_file(DataFilter *filter, int file_fd, off_t offset, off_t end) {
+  Uring *ring = end != -1 ? worker_ring() : NULL;
+  if (ring != NULL)
+    return filter_file_uring(ring, filter, file_fd, offset, end);
+
+  while (end == -1 || offset < end) {
+    size_t len = end != -1 && end - offset < PIPE_CHUNK ? end - offset
+                                                         : PIPE_CHUNK;
+    ssize_t got = end == -1 ? read(file_fd, filter->in, len)
+                            : pread(file_fd, filter->in, len, offset);
+    if (got < 0) {
+      if (errno == EINTR)
+        continue;
+      log_perror(ERR_OPEN_FILE);
+      return -1;
+    }
+    if (got == 0)
+      break;
+    if (!filter_write(filter, filter->in, got, Z_NO_FLUSH))
+      return -1;
+    offset += got;
+  }
+  return offset;
+}
+
+// filter_file() with the reads ahead of the encoder: every registered
+// buffer of the ring has a read in flight and the oldest is encoded while
+// the others are being read.
+off_t filter_file_uring(Uring *ring, DataFilter *filter, int file_fd,
+                        off_t offset, off_t end) {
+  unsigned count = ring->buffer_count;
+  ssize_t results[count];
+  size_t lens[count];
+  bool done[count];
+  unsigned head = 0, tail = 0; // reads consumed, reads queued
+  off_t next = offset;
+  bool failed = false, stop = false;
+
+  while (1) {
+    while (!failed && !stop && next < end && tail - head < count) {
+      unsigned i = tail % count;
+      struct io_uring_sqe *sqe = uring_sqe(ring);
+      if (sqe == NULL) {
+        failed = true;
+        break;
+      }
+      lens[i] = end - next < ring->buffer_size ? end - next : ring->buffer_size;
+      uring_prep(sqe, IORING_OP_READ_FIXED, file_fd, uring_buffer(ring, i),
+                 lens[i], next, i);
+      sqe->buf_index = i;
+      done[i] = false;
+      next += lens[i];
+      tail++;
+    }
+    if (head == tail)
+      break;
+
+    unsigned i = head % count;
+    while (!done[i]) {
+      struct io_uring_cqe *cqe = uring_wait(ring);
+      if (cqe == NULL) {
+        log_perror(ERR_URING_FAIL);
+        worker_ring_drain(ring);
+        return -1;
+      }
+      if (cqe->user_data < count) {
+        results[cqe->user_data] = cqe->res;
+        done[cqe->user_data] = true;
+      }
+      uring_seen(ring);
+    }
+    head++;
+
+    // after an error or a short read the rest is only drained
+    if (failed || stop)
+      continue;
+    if (results[i] < 0) {
+      errno = -results[i];
+      log_perror(ERR_OPEN_FILE);
+      failed = true;
+    } else if (!filter_write(filter, uring_buffer(ring, i), results[i],
+                             Z_NO_FLUSH)) {
+      failed = true;
+    } else {
+      offset += results[i];
+      stop = (size_t)results[i] < lens[i]; // file truncated while sending
+    }
+  }
+  return failed ? -1 : offset;
+}
+
+// Switches to storing for archive members that are compressed already
+void filter_level(DataFilter *filter, const char *name) {
+  int level = compressed_name(name) ? Z_NO_COMPRESSION : Z_DEFAULT_COMPRESSION;
+
+  if (!filter->deflate)
+    return;
+
+  // deflateParams() needs the pending input compressed with the old level
+  // and room to write it
+  filter_send(filter, NULL, 0, Z_BLOCK);
+  filter->stream.next_out = filter->out;
+  filter->stream.avail_out = PIPE_CHUNK;
+  deflateParams(&filter->stream, level, Z_DEFAULT_STRATEGY);
+  size_t ready = PIPE_CHUNK - filter->stream.avail_out;
+  if (ready > 0 && !send_all(filter->socket, (char *)filter->out, ready))
+    log_perror(ERR_SEND_FAIL);
+}
+
+// Extensions of formats that don't get any smaller by deflating them
+bool compressed_name(const char *name) {
+  static const char *extensions[] = {
+      ".zip", ".gz",  ".tgz", ".bz2", ".xz",  ".zst", ".7z",  ".rar",
+      ".lzh", ".arj", ".zoo", ".jpg", ".jpeg", ".png", ".gif", ".mp3",
+      ".mp4", ".mkv", ".avi", ".ogg", ".flac", ".webp", NULL};
+  const char *dot = name != NULL ? strrchr(name, '.') : NULL;
+
+  if (dot == NULL || strchr(dot, '/') != NULL)
+    return false;
+  for (const char **extension = extensions; *extension; extension++)
+    if (strcasecmp(dot, *extension) == 0)
+      return true;
+  return false;
+}
+
+// Uploads are spliced socket -> pipe -> file so the data is never copied to
+// user space. When the size is known (ALLO) the file is preallocated to keep
+// it contiguous on disk and to fail early on a full disk. Data is written
+// from offset (REST) or from the end of the file when appending, a plain
+// STOR replaces the file.
+bool receive_file(int socket, const char *filename, off_t alloc_size,
+                  off_t offset, bool append, DataFilter *filter) {
   int file_fd;
-  char buffer[BUFFER_SIZE];
-  ssize_t bytes_received;
+  struct timespec start;
+  int flags = O_WRONLY | O_CREAT;
 
-  printf("- receiving file %s\n", filename);
-  file_fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (offset == 0 && !append)
+    flags |= O_TRUNC;
+
+  log_debug(LOG_RECEIVING_FILE, filename);
+  file_fd = open(filename, flags, 0644);
   if (file_fd == -1) {
-    perror(ERR_CREATE_FILE);
-    return;
+    log_perror(ERR_CREATE_FILE);
+    return false;
+  }
+  stat_cache_invalidate(filename);
+
+  offset = lseek(file_fd, offset, append ? SEEK_END : SEEK_SET);
+  if (offset == -1) {
+    log_perror(ERR_WRITE_FILE);
+    close(file_fd);
+    return false;
   }
 
-  while ((bytes_received = recv(socket, buffer, BUFFER_SIZE, 0)) > 0) {
-    write(file_fd, buffer, bytes_received);
+  if (alloc_size > 0 &&
+      fallocate(file_fd, FALLOC_FL_KEEP_SIZE, offset, alloc_size) == -1 &&
+      errno != EOPNOTSUPP) {
+    log_perror(ERR_WRITE_FILE);
+    close(file_fd);
+    return false;
   }
 
-  close(file_fd);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  Uring *ring = filter == NULL ? worker_ring() : NULL;
+  ssize_t total = filter != NULL ? receive_file_filtered(filter, file_fd)
+                  : ring != NULL ? receive_file_uring(ring, socket, file_fd,
+                                                      offset)
+                                 : receive_file_splice(socket, file_fd);
+  double seconds = elapsed_seconds(&start);
+
+  // truncating to the current size drops whatever the preallocation
+  // reserved beyond the received data
+  struct stat file_stat;
+  if (total >= 0 && alloc_size > total &&
+      (fstat(file_fd, &file_stat) == -1 ||
+       ftruncate(file_fd, file_stat.st_size) == -1))
+    total = -1;
+
+  if (close(file_fd) == -1 || total < 0) {
+    log_perror(ERR_WRITE_FILE);
+    return false;
+  }
+
+  log_write(LOG_LEVEL_INFO, total, seconds, LOG_RECEIVED_FILE, filename,
+            seconds > 0 ? total / 1024.0 / seconds : 0.0);
+  return true;
+}
+
+// Returns the number of bytes stored or -1 on error.
+ssize_t receive_file_splice(int socket, int file_fd) {
+  int pipe_fd[2];
+  ssize_t total = 0;
+
+  if (!create_pipe(pipe_fd))
+    return receive_file_copy(socket, file_fd);
+
+  while (1) {
+    ssize_t in = splice(socket, NULL, pipe_fd[1], NULL,
+                        throttle_quantum(socket, RECV_CHUNK),
+                        SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (in < 0 && errno == EINTR)
+      continue;
+    if (in < 0 && errno == EINVAL && total == 0) {
+      close(pipe_fd[0]);
+      close(pipe_fd[1]);
+      return receive_file_copy(socket, file_fd);
+    }
+    if (in <= 0) {
+      if (in < 0)
+        total = -1;
+      break;
+    }
+    throttle_charge(socket, in);
+
+    while (in > 0) {
+      ssize_t out =
+          splice(pipe_fd[0], NULL, file_fd, NULL, in, SPLICE_F_MOVE);
+      if (out <= 0) {
+        if (out < 0 && errno == EINTR)
+          continue;
+        total = -1;
+        break;
+      }
+      in -= out;
+      total += out;
+    }
+    if (total < 0)
+      break;
+  }
+
+  close(pipe_fd[0]);
+  close(pipe_fd[1]);
+  return total;
+}
+
+// Uploads with io_uring: one recv at a time fills a free registered buffer
+// (MSG_WAITALL, so whole buffers) while the full ones are written out at
+// their offsets, the disk writes overlap the network. Each round trip
+// submits the next requests and waits in the same system call.
+ssize_t receive_file_uring(Uring *ring, int socket, int file_fd,
+                           off_t offset) {
+  struct {
+    off_t offset;
+    size_t len;
+    size_t written;
+  } chunks[WORKER_RING_BUFFERS];
+  unsigned free_buffers = (1u << ring->buffer_count) - 1;
+  unsigned writes = 0, receive_buffer = 0;
+  bool receiving = false, eof = false, failed = false;
+  ssize_t total = 0;
+
+  while (1) {
+    struct io_uring_sqe *sqe;
+    if (!receiving && !eof && !failed && free_buffers != 0) {
+      unsigned i = __builtin_ctz(free_buffers);
+      if ((sqe = uring_sqe(ring)) == NULL) {
+        failed = true;
+      } else {
+        uring_prep(sqe, IORING_OP_RECV, socket, uring_buffer(ring, i),
+                   throttle_quantum(socket, ring->buffer_size), 0,
+                   URING_RECV_TAG | i);
+        sqe->msg_flags = MSG_WAITALL;
+        free_buffers &= ~(1u << i);
+        receive_buffer = i;
+        receiving = true;
+      }
+    }
+    if (!receiving && writes == 0)
+      break;
+
+    struct io_uring_cqe *cqe = uring_wait(ring);
+    if (cqe == NULL) {
+      log_perror(ERR_URING_FAIL);
+      // the client may never send again, the recv won't end on its own
+      if (receiving)
+        uring_cancel(ring, URING_RECV_TAG | receive_buffer);
+      worker_ring_drain(ring);
+      return -1;
+    }
+    unsigned i = cqe->user_data & ~URING_RECV_TAG;
+    bool recv_done = cqe->user_data & URING_RECV_TAG;
+    int result = cqe->res;
+    uring_seen(ring);
+    if (i >= ring->buffer_count || (recv_done && !receiving))
+      continue; // not one of ours
+
+    if (recv_done) {
+      receiving = false;
+      if (result <= 0) {
+        if (result == -EINTR || result == -EAGAIN) {
+          free_buffers |= 1u << i;
+          continue;
+        }
+        if (result < 0) {
+          errno = -result;
+          failed = true;
+        }
+        eof = true;
+        free_buffers |= 1u << i;
+        continue;
+      }
+      throttle_charge(socket, result);
+      chunks[i].offset = offset;
+      chunks[i].len = result;
+      chunks[i].written = 0;
+      offset += result;
+      total += result;
+      writes++;
+    } else if (result <= 0) {
+      errno = result < 0 ? -result : EIO;
+      failed = true;
+      writes--;
+      free_buffers |= 1u << i;
+      continue;
+    } else if ((chunks[i].written += result) == chunks[i].len) {
+      writes--;
+      free_buffers |= 1u << i;
+      continue;
+    }
+
+    // the chunk just received, or what a short write left of it
+    if ((sqe = uring_sqe(ring)) == NULL) {
+      failed = true;
+      writes--;
+      free_buffers |= 1u << i;
+      continue;
+    }
+    uring_prep(sqe, IORING_OP_WRITE_FIXED, file_fd,
+               uring_buffer(ring, i) + chunks[i].written,
+               chunks[i].len - chunks[i].written,
+               chunks[i].offset + chunks[i].written, i);
+    sqe->buf_index = i;
+  }
+  return failed ? -1 : total;
+}
+
+// Fallback for when splice isn't available: a large page aligned buffer,
+// allocated once per worker thread and reused for every upload.
+ssize_t receive_file_copy(int socket, int file_fd) {
+  static __thread char *buffer = NULL;
+  ssize_t bytes_received, total = 0;
+
+  if (buffer == NULL && posix_memalign((void **)&buffer, 4096, RECV_CHUNK)) {
+    buffer = NULL;
+    return -1;
+  }
+
+  while ((bytes_received = recv(socket, buffer,
+                                throttle_quantum(socket, RECV_CHUNK), 0)) !=
+         0) {
+    if (bytes_received < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    throttle_charge(socket, bytes_received);
+    if (!write_all(file_fd, buffer, bytes_received))
+      return -1;
+    total += bytes_received;
+  }
+
+  return total;
+}
+
+// MODE Z and TYPE A uploads, returns the number of bytes stored or -1 on
+// error.
+ssize_t receive_file_filtered(DataFilter *filter, int file_fd) {
+  z_stream *stream = &filter->stream;
+  ssize_t bytes_received, total = 0;
+  int result = Z_OK;
+
+  while (result != Z_STREAM_END &&
+         (bytes_received =
+              recv(filter->socket, filter->in,
+                   throttle_quantum(filter->socket, PIPE_CHUNK), 0)) != 0) {
+    if (bytes_received < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    throttle_charge(filter->socket, bytes_received);
+    if (!filter->deflate) {
+      if (!filter_store(filter, file_fd, filter->in, bytes_received, &total))
+        return -1;
+      continue;
+    }
+
+    stream->next_in = filter->in;
+    stream->avail_in = bytes_received;
+    do {
+      stream->next_out = filter->out;
+      stream->avail_out = PIPE_CHUNK;
+      result = inflate(stream, Z_NO_FLUSH);
+      if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR) {
+        log_error(ERR_ZLIB_FAIL, stream->msg ? stream->msg : "upload");
+        return -1;
+      }
+      if (!filter_store(filter, file_fd, filter->out,
+                        PIPE_CHUNK - stream->avail_out, &total))
+        return -1;
+    } while (stream->avail_out == 0);
+  }
+
+  // a deflate stream cut short means the upload was incomplete
+  if (filter->deflate && result != Z_STREAM_END)
+    return -1;
+  // a CR at the very end wasn't followed by an LF
+  if (filter->pending_cr) {
+    if (!write_all(file_fd, "\r", 1))
+      return -1;
+    total++;
+  }
+  return total;
+}
+
+// Last stage of an upload, turns CRLF back into LF for TYPE A
+bool filter_store(DataFilter *filter, int file_fd, const void *data,
+                  size_t len, ssize_t *total) {
+  if (filter->ascii) {
+    len = ascii_decode(data, len, filter->text, &filter->pending_cr);
+    data = filter->text;
+  }
+  if (!write_all(file_fd, data, len))
+    return false;
+  *total += len;
+  return true;
 }
 
 bool cmd_user(ClientConnection *conn, const char *arg) {
@@ -484,6 +3267,7 @@ bool cmd_user(ClientConnection *conn, const char *arg) {
 }
 
 bool cmd_pass(ClientConnection *conn, const char *arg) {
+  conn->logged_in = true;
   send_response(conn->control_socket, MSG_USER_LOGGED);
   return false;
 }
@@ -498,12 +3282,36 @@ bool cmd_cwd(ClientConnection *conn, const char *arg) {
   return false;
 }
 
+// TYPE A [N] and TYPE I (or L 8, the same thing on a byte machine)
 bool cmd_type(ClientConnection *conn, const char *arg) {
-  send_response(conn->control_socket, MSG_TYPE_OK);
+  char type = toupper((unsigned char)arg[0]);
+  const char *param = arg[0] != '\0' ? arg + 1 : arg;
+
+  while (*param == ' ')
+    param++;
+  if ((type == 'A' && (*param == '\0' || toupper(*param) == 'N')) ||
+      (type == 'I' && *param == '\0') ||
+      (type == 'L' && strcmp(param, "8") == 0)) {
+    conn->type_ascii = type == 'A';
+    send_response(conn->control_socket, MSG_TYPE_OK, type == 'A' ? 'A' : 'I');
+  } else
+    send_response(conn->control_socket, MSG_TYPE_FAIL);
   return false;
 }
 
 bool cmd_pasv(ClientConnection *conn, const char *arg) {
+  if (conn->data_socket < 0) {
+    conn->data_socket = port_pool_acquire();
+    conn->data_pooled = conn->data_socket >= 0;
+    // pool exhausted, fall back to an ephemeral port
+    if (conn->data_socket < 0)
+      conn->data_socket = create_data_socket(0);
+    if (conn->data_socket < 0) {
+      send_response(conn->control_socket, MSG_DATA_CONN_FAIL);
+      return false;
+    }
+  }
+
   struct sockaddr_in addr;
   socklen_t len = sizeof(addr);
   getsockname(conn->data_socket, (struct sockaddr *)&addr, &len);
@@ -520,91 +3328,377 @@ bool cmd_pasv(ClientConnection *conn, const char *arg) {
 
 bool cmd_nlst(ClientConnection *conn, const char *arg) {
   send_response(conn->control_socket, MSG_LIST_START);
-  int data_conn = accept(conn->data_socket, NULL, NULL);
+  int data_conn = accept_data_connection(conn);
   if (data_conn < 0) {
-    perror(ERR_ACCEPT_FAIL);
+    log_perror(ERR_ACCEPT_FAIL);
     send_response(conn->control_socket, MSG_DATA_CONN_FAIL);
   } else {
-    list_directory(data_conn, conn->current_dir);
-    close(data_conn);
-    send_response(conn->control_socket, MSG_RETR_END);
+    DataFilter *filter;
+    bool ok = filter_begin(conn, data_conn, conn->current_dir, FILTER_LISTING,
+                           &filter);
+    if (ok)
+      send_listing(data_conn, conn->current_dir, false, filter);
+    ok = filter_end(filter, conn->current_dir, ok);
+    ok = close_data_connection(conn, data_conn) && ok;
+    send_response(conn->control_socket, ok ? MSG_RETR_END : MSG_TRANSFER_FAIL);
   }
+  release_data_socket(conn);
   return false;
 }
 
 bool cmd_dir(ClientConnection *conn, const char *arg) {
   send_response(conn->control_socket, MSG_LIST_START);
-  int data_conn = accept(conn->data_socket, NULL, NULL);
+  int data_conn = accept_data_connection(conn);
   if (data_conn < 0) {
-    perror(ERR_ACCEPT_FAIL);
+    log_perror(ERR_ACCEPT_FAIL);
     send_response(conn->control_socket, MSG_DATA_CONN_FAIL);
   } else {
-    list_directory_extend(data_conn, conn->current_dir);
-    close(data_conn);
-    send_response(conn->control_socket, MSG_RETR_END);
+    DataFilter *filter;
+    bool ok = filter_begin(conn, data_conn, conn->current_dir, FILTER_LISTING,
+                           &filter);
+    if (ok)
+      send_listing(data_conn, conn->current_dir, true, filter);
+    ok = filter_end(filter, conn->current_dir, ok);
+    ok = close_data_connection(conn, data_conn) && ok;
+    send_response(conn->control_socket, ok ? MSG_RETR_END : MSG_TRANSFER_FAIL);
   }
+  release_data_socket(conn);
   return false;
 }
 
 bool cmd_retr(ClientConnection *conn, const char *arg) {
-  send_response(conn->control_socket, MSG_STOR_START);
-  int data_conn = accept(conn->data_socket, NULL, NULL);
+  send_response(conn->control_socket, MSG_STOR_START,
+                conn->type_ascii ? "ASCII" : "BINARY");
+  int data_conn = accept_data_connection(conn);
   if (data_conn < 0) {
-    perror(ERR_ACCEPT_FAIL);
+    log_perror(ERR_ACCEPT_FAIL);
     send_response(conn->control_socket, MSG_DATA_CONN_FAIL);
   } else {
     char full_path[MAX_PATH];
-    snprintf(full_path, MAX_PATH, "%s/%s", conn->current_dir, arg);
-    send_file(data_conn, full_path);
-    close(data_conn);
-    send_response(conn->control_socket, MSG_RETR_END);
+    char dir_path[MAX_PATH];
+    bool zip;
+    DataFilter *filter;
+    build_path(conn, arg, full_path);
+    bool ok =
+        filter_begin(conn, data_conn, full_path, FILTER_DOWNLOAD, &filter);
+    if (ok && conn->restart_offset == 0 &&
+        archive_source(full_path, dir_path, &zip))
+      ok = send_archive(data_conn, dir_path, zip, filter);
+    else if (ok)
+      ok = send_file(data_conn, full_path, conn->restart_offset, filter);
+    ok = filter_end(filter, full_path, ok);
+    ok = close_data_connection(conn, data_conn) && ok;
+    send_response(conn->control_socket, ok ? MSG_RETR_END : MSG_TRANSFER_FAIL);
   }
+  conn->restart_offset = 0;
+  release_data_socket(conn);
   return false;
 }
 
+// Sends every file named by the space separated arguments, which may be
+// glob patterns, over consecutive data connections to the same passive
+// port. Each file gets a 150 naming it and a 226 (or a 550 if it can't be
+// opened), directories are skipped and a final 250 ends the batch. The
+// next file is opened and read ahead while the current one drains.
 bool cmd_mretr(ClientConnection *conn, const char *arg) {
-  char *token;
   char *saveptr;
-  char args_copy[MAX_PATH];
+  char *args_copy = strdup(arg);
+  glob_t matches;
+  int glob_flags = GLOB_NOCHECK | GLOB_MARK;
+  size_t sent = 0;
+  struct timespec start;
+
+  if (args_copy == NULL) {
+    log_perror(ERR_ALLOC_FAIL);
+    send_response(conn->control_socket, MSG_TRANSFER_FAIL);
+    release_data_socket(conn);
+    return false;
+  }
 
-  strncpy(args_copy, arg, MAX_PATH - 1);
-  args_copy[MAX_PATH - 1] = '\0';
+  // GLOB_NOCHECK keeps patterns without matches, they fail to open below
+  // and get their 550 like any missing file
+  for (char *token = strtok_r(args_copy, " ", &saveptr); token != NULL;
+       token = strtok_r(NULL, " ", &saveptr)) {
+    char pattern[MAX_PATH];
+    build_path(conn, token, pattern);
+    glob(pattern, glob_flags, NULL, &matches);
+    glob_flags |= GLOB_APPEND;
+  }
+  free(args_copy);
+
+  // GLOB_MARK ends directories with a slash, drop them from the list
+  size_t count = 0;
+  for (size_t i = 0; glob_flags & GLOB_APPEND && i < matches.gl_pathc; i++) {
+    char *path = matches.gl_pathv[i];
+    if (path[strlen(path) - 1] != '/') {
+      matches.gl_pathv[i] = matches.gl_pathv[count];
+      matches.gl_pathv[count++] = path;
+    }
+  }
 
-  token = strtok_r(args_copy, " ", &saveptr);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  // open the first file now, later ones while their predecessor is sent
+  int next_fd = count > 0 ? prefetch_file(matches.gl_pathv[0]) : -1;
+  size_t i;
+  for (i = 0; i < count; i++) {
+    const char *path = matches.gl_pathv[i];
+    const char *name = path;
+    size_t dir_len = strlen(conn->current_dir);
+    if (strncmp(path, conn->current_dir, dir_len) == 0 && path[dir_len] == '/')
+      name += dir_len + 1;
+
+    int file_fd = next_fd;
+    next_fd = i + 1 < count ? prefetch_file(matches.gl_pathv[i + 1]) : -1;
+
+    struct stat file_stat;
+    if (file_fd == -1 || fstat(file_fd, &file_stat) == -1) {
+      log_perror(ERR_OPEN_FILE);
+      send_response(conn->control_socket, MSG_BATCH_FILE_FAIL, name);
+      if (file_fd != -1)
+        close(file_fd);
+      continue;
+    }
 
-  while (token != NULL) {
-    send_response(conn->control_socket, MSG_STOR_START);
-    int data_conn = accept(conn->data_socket, NULL, NULL);
+    send_response(conn->control_socket, MSG_BATCH_START,
+                  conn->type_ascii ? "ASCII" : "BINARY", name,
+                  (long long)file_stat.st_size);
+    int data_conn = accept_data_connection(conn);
     if (data_conn < 0) {
-      perror(ERR_ACCEPT_FAIL);
+      log_perror(ERR_ACCEPT_FAIL);
       send_response(conn->control_socket, MSG_DATA_CONN_FAIL);
-    } else {
-      char full_path[MAX_PATH];
-      snprintf(full_path, MAX_PATH, "%s/%s", conn->current_dir, token);
-      send_file(data_conn, full_path);
-      close(data_conn);
-      send_response(conn->control_socket, MSG_RETR_END);
+      close(file_fd);
+      break;
     }
 
-    token = strtok_r(NULL, " ", &saveptr);
+    log_debug(LOG_SENDING_FILE, path);
+    DataFilter *filter;
+    bool ok = filter_begin(conn, data_conn, path, FILTER_DOWNLOAD, &filter);
+    if (ok && !send_cached_file(data_conn, path, 0, filter, &ok))
+      ok = send_open_file(data_conn, file_fd, 0, filter);
+    ok = filter_end(filter, path, ok);
+    close(file_fd);
+    ok = close_data_connection(conn, data_conn) && ok;
+    send_response(conn->control_socket, ok ? MSG_RETR_END : MSG_TRANSFER_FAIL);
+    sent += ok;
   }
-
+  if (i < count) { // aborted, send no 250
+    if (next_fd != -1)
+      close(next_fd);
+  } else
+    send_response(conn->control_socket, MSG_BATCH_END, sent, count);
+
+  log_write(LOG_LEVEL_INFO, -1, elapsed_seconds(&start), LOG_BATCH_SENT, sent,
+            count);
+  if (glob_flags & GLOB_APPEND)
+    globfree(&matches);
+  release_data_socket(conn);
   return false;
 }
 
 bool cmd_stor(ClientConnection *conn, const char *arg) {
-  send_response(conn->control_socket, MSG_STOR_START);
-  int data_conn = accept(conn->data_socket, NULL, NULL);
+  return store_file(conn, arg, false);
+}
+
+bool cmd_appe(ClientConnection *conn, const char *arg) {
+  return store_file(conn, arg, true);
+}
+
+bool store_file(ClientConnection *conn, const char *arg, bool append) {
+  send_response(conn->control_socket, MSG_STOR_START,
+                conn->type_ascii ? "ASCII" : "BINARY");
+  int data_conn = accept_data_connection(conn);
   if (data_conn < 0) {
-    perror(ERR_ACCEPT_FAIL);
+    log_perror(ERR_ACCEPT_FAIL);
     send_response(conn->control_socket, MSG_DATA_CONN_FAIL);
   } else {
     char full_path[MAX_PATH];
-    snprintf(full_path, MAX_PATH, "%s/%s", conn->current_dir, arg);
-    receive_file(data_conn, full_path);
-    close(data_conn);
-    send_response(conn->control_socket, MSG_STOR_END);
+    build_path(conn, arg, full_path);
+    DataFilter *filter;
+    bool ok =
+        filter_begin(conn, data_conn, full_path, FILTER_UPLOAD, &filter) &&
+        receive_file(data_conn, full_path, conn->alloc_size,
+                     conn->restart_offset, append, filter);
+    ok = filter_end(filter, full_path, ok);
+    ok = close_data_connection(conn, data_conn) && ok;
+    send_response(conn->control_socket, ok ? MSG_STOR_END : MSG_TRANSFER_FAIL);
+  }
+  conn->alloc_size = 0;
+  conn->restart_offset = 0;
+  release_data_socket(conn);
+  return false;
+}
+
+bool cmd_allo(ClientConnection *conn, const char *arg) {
+  char *end;
+  long long size = strtoll(arg, &end, 10);
+  if (end == arg || *end != '\0' || size < 0) {
+    send_response(conn->control_socket, MSG_ARG_ERROR);
+    return false;
+  }
+  conn->alloc_size = size;
+  send_response(conn->control_socket, MSG_ALLO_OK);
+  return false;
+}
+
+bool cmd_rest(ClientConnection *conn, const char *arg) {
+  char *end;
+  long long offset = strtoll(arg, &end, 10);
+  if (*end != '\0' || offset < 0) {
+    send_response(conn->control_socket, MSG_ARG_ERROR);
+    return false;
+  }
+  conn->restart_offset = offset;
+  send_response(conn->control_socket, MSG_REST_OK, offset);
+  return false;
+}
+
+bool cmd_size(ClientConnection *conn, const char *arg) {
+  char full_path[MAX_PATH];
+  struct stat file_stat;
+
+  build_path(conn, arg, full_path);
+  if (!cached_stat(full_path, &file_stat) || !S_ISREG(file_stat.st_mode))
+    send_response(conn->control_socket, MSG_FILE_FAIL);
+  else
+    send_response(conn->control_socket, MSG_SIZE,
+                  (long long)file_stat.st_size);
+  return false;
+}
+
+bool cmd_mdtm(ClientConnection *conn, const char *arg) {
+  char full_path[MAX_PATH];
+  struct stat file_stat;
+  struct tm tm_info;
+  char time_buffer[32];
+
+  build_path(conn, arg, full_path);
+  if (!cached_stat(full_path, &file_stat)) {
+    send_response(conn->control_socket, MSG_FILE_FAIL);
+    return false;
   }
+  gmtime_r(&file_stat.st_mtime, &tm_info);
+  strftime(time_buffer, sizeof(time_buffer), "%Y%m%d%H%M%S", &tm_info);
+  send_response(conn->control_socket, MSG_MDTM, time_buffer);
+  return false;
+}
+
+bool cmd_feat(ClientConnection *conn, const char *arg) {
+  char types[64] = "";
+  size_t len = 0;
+
+  // the session's HASH algorithm is marked with a *
+  for (DigestType type = 0; type < DIGEST_TYPES; type++)
+    len += snprintf(types + len, sizeof(types) - len, "%s%s%s",
+                    len ? ";" : "", digest_name(type),
+                    type == conn->hash_type ? "*" : "");
+  send_response(conn->control_socket, MSG_FEAT, types);
+  return false;
+}
+
+// XCRC and XMD5 take "file [start [end]]", end exclusive
+bool cmd_xcrc(ClientConnection *conn, const char *arg) {
+  return send_checksum(conn, arg, DIGEST_CRC32);
+}
+
+bool cmd_xmd5(ClientConnection *conn, const char *arg) {
+  return send_checksum(conn, arg, DIGEST_MD5);
+}
+
+bool send_checksum(ClientConnection *conn, const char *arg, DigestType type) {
+  char name[MAX_PATH];
+  char full_path[MAX_PATH];
+  char hex[DIGEST_HEX_SIZE];
+  off_t start, end, size;
+
+  if (!parse_range(arg, name, &start, &end)) {
+    send_response(conn->control_socket, MSG_ARG_ERROR);
+    return false;
+  }
+  build_path(conn, name, full_path);
+  if (!file_digest(full_path, type, start, end, hex, &size)) {
+    send_response(conn->control_socket, MSG_FILE_FAIL);
+    return false;
+  }
+  for (char *c = hex; *c; c++)
+    *c = toupper((unsigned char)*c);
+  send_response(conn->control_socket, MSG_CHECKSUM, hex);
+  return false;
+}
+
+// HASH file, with the algorithm of OPTS HASH over the range of RANG
+bool cmd_hash(ClientConnection *conn, const char *arg) {
+  char full_path[MAX_PATH];
+  char hex[DIGEST_HEX_SIZE];
+  off_t start = conn->range_set ? conn->range_start : 0;
+  off_t end = conn->range_set ? conn->range_end : -1;
+  off_t size;
+
+  conn->range_set = false;
+  build_path(conn, arg, full_path);
+  if (!file_digest(full_path, conn->hash_type, start, end, hex, &size)) {
+    send_response(conn->control_socket, MSG_FILE_FAIL);
+    return false;
+  }
+  if (end == -1 || end > size)
+    end = size;
+  send_response(conn->control_socket, MSG_HASH,
+                digest_name(conn->hash_type), (long long)start,
+                (long long)(end > start ? end - 1 : start), hex, arg);
+  return false;
+}
+
+// RANG start end, end inclusive, "RANG 1 0" clears it
+bool cmd_rang(ClientConnection *conn, const char *arg) {
+  long long start, end;
+  int used = 0;
+
+  if (sscanf(arg, "%lld %lld%n", &start, &end, &used) != 2 ||
+      arg[used] != '\0' || start < 0 || end < 0) {
+    send_response(conn->control_socket, MSG_ARG_ERROR);
+    return false;
+  }
+  if (start == 1 && end == 0) {
+    conn->range_set = false;
+    send_response(conn->control_socket, MSG_RANG_RESET);
+    return false;
+  }
+  if (end < start) {
+    send_response(conn->control_socket, MSG_ARG_ERROR);
+    return false;
+  }
+  conn->range_set = true;
+  conn->range_start = start;
+  conn->range_end = end + 1;
+  send_response(conn->control_socket, MSG_RANG_OK, start, end);
+  return false;
+}
+
+// Only OPTS HASH [algorithm] for now
+bool cmd_opts(ClientConnection *conn, const char *arg) {
+  if (strncasecmp(arg, "HASH", 4) != 0 || (arg[4] != '\0' && arg[4] != ' ')) {
+    send_response(conn->control_socket, MSG_ARG_ERROR);
+    return false;
+  }
+  const char *name = arg + 4;
+  while (*name == ' ')
+    name++;
+  if (*name != '\0' && !digest_parse(name, &conn->hash_type)) {
+    send_response(conn->control_socket, MSG_ARG_ERROR);
+    return false;
+  }
+  send_response(conn->control_socket, MSG_HASH_TYPE,
+                digest_name(conn->hash_type));
+  return false;
+}
+
+bool cmd_mode(ClientConnection *conn, const char *arg) {
+  char mode = toupper((unsigned char)arg[0]);
+  if ((mode != 'S' && mode != 'Z') || arg[1] != '\0') {
+    send_response(conn->control_socket, MSG_MODE_FAIL);
+    return false;
+  }
+  conn->mode_z = mode == 'Z';
+  send_response(conn->control_socket, MSG_MODE_OK, mode);
   return false;
 }
 
@@ -614,22 +3708,219 @@ bool cmd_quit(ClientConnection *conn, const char *arg) {
 }
 
 bool handle_command(ClientConnection *conn, char *buffer) {
-  char *command = strtok(buffer, " \r\n");
-  char *arg = strtok(NULL, "\r\n");
+  char *saveptr;
+  char *command = strtok_r(buffer, " \r\n", &saveptr);
+  char *arg = strtok_r(NULL, "\r\n", &saveptr);
 
   if (command == NULL) {
     send_response(conn->control_socket, MSG_SYNTAX_ERROR);
     return false;
   }
 
+  FtpCommand *cmd = find_command(command);
+  if (cmd == NULL) {
+    send_response(conn->control_socket, MSG_NOT_IMPLEMENTED);
+    return false;
+  }
+
+  if ((cmd->flags & CMD_LOGIN) && !conn->logged_in) {
+    send_response(conn->control_socket, MSG_NOT_LOGGED);
+    return false;
+  }
+  if ((cmd->flags & CMD_ARG) && arg == NULL) {
+    send_response(conn->control_socket, MSG_ARG_ERROR);
+    return false;
+  }
+  if ((cmd->flags & CMD_PASV) && conn->data_socket < 0) {
+    send_response(conn->control_socket, MSG_USE_PASV);
+    return false;
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  log_set_context(conn->id, cmd->command);
+  bool done = cmd->handler(conn, arg);
+  double seconds = elapsed_seconds(&start);
+
+  unsigned long calls = __atomic_add_fetch(&cmd->calls, 1, __ATOMIC_RELAXED);
+  unsigned long long total = __atomic_add_fetch(
+      &cmd->nanoseconds, (unsigned long long)(seconds * 1e9), __ATOMIC_RELAXED);
+  log_write(LOG_LEVEL_DEBUG, -1, seconds, LOG_COMMAND_TIME, calls,
+            total / 1e6 / calls);
+  log_set_context(conn->id, NULL);
+  return done;
+}
+
+// Commands are at most four letters or digits (XMD5), packed uppercase into
+// one word they are compared with a single integer comparison. 0 means not
+// a command.
+uint32_t command_key(const char *command) {
+  uint32_t key = 0;
+  int i;
+
+  for (i = 0; command[i] != '\0'; i++) {
+    if (i == 4 || !isalnum((unsigned char)command[i]))
+      return 0;
+    key = (key << 8) | toupper((unsigned char)command[i]);
+  }
+  return key;
+}
+
+unsigned int command_slot(uint32_t key) {
+  return (key * 2654435761u) >> (32 - COMMAND_TABLE_BITS);
+}
+
+void build_command_table() {
   for (FtpCommand *cmd = ftp_commands; cmd->command != NULL; cmd++) {
-    if (strcasecmp(command, cmd->command) == 0) {
-      return cmd->handler(conn, arg);
-    }
+    cmd->key = command_key(cmd->command);
+    unsigned int slot = command_slot(cmd->key);
+    while (command_table[slot] != NULL)
+      slot = (slot + 1) % COMMAND_TABLE_SIZE;
+    command_table[slot] = cmd;
   }
+}
 
-  send_response(conn->control_socket, MSG_NOT_IMPLEMENTED);
-  return false;
+FtpCommand *find_command(const char *command) {
+  uint32_t key = command_key(command);
+  if (key == 0)
+    return NULL;
+
+  unsigned int slot = command_slot(key);
+  while (command_table[slot] != NULL) {
+    if (command_table[slot]->key == key)
+      return command_table[slot];
+    slot = (slot + 1) % COMMAND_TABLE_SIZE;
+  }
+  return NULL;
+}
+
+// Absolute arguments are taken as they are, others are relative to the
+// session's current directory.
+void build_path(ClientConnection *conn, const char *arg, char *full_path) {
+  if (arg[0] == '/')
+    snprintf(full_path, MAX_PATH, "%s", arg);
+  else
+    snprintf(full_path, MAX_PATH, "%s/%s", conn->current_dir, arg);
+}
+
+// FNV-1a
+unsigned int hash_path(const char *path) {
+  unsigned int hash = 2166136261u;
+  for (; *path; path++)
+    hash = (hash ^ (unsigned char)*path) * 16777619u;
+  return hash;
+}
+
+bool cached_stat(const char *path, struct stat *file_stat) {
+  StatCacheEntry *entry =
+      &stat_cache.entries[hash_path(path) % STAT_CACHE_SIZE];
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&stat_cache.lock);
+  if (now - entry->loaded < STAT_CACHE_TTL && strcmp(entry->path, path) == 0) {
+    *file_stat = entry->file_stat;
+    pthread_mutex_unlock(&stat_cache.lock);
+    return true;
+  }
+  pthread_mutex_unlock(&stat_cache.lock);
+
+  if (stat(path, file_stat) == -1)
+    return false;
+
+  pthread_mutex_lock(&stat_cache.lock);
+  snprintf(entry->path, sizeof(entry->path), "%s", path);
+  entry->loaded = now;
+  entry->file_stat = *file_stat;
+  pthread_mutex_unlock(&stat_cache.lock);
+  return true;
+}
+
+void stat_cache_invalidate(const char *path) {
+  StatCacheEntry *entry =
+      &stat_cache.entries[hash_path(path) % STAT_CACHE_SIZE];
+
+  pthread_mutex_lock(&stat_cache.lock);
+  if (strcmp(entry->path, path) == 0)
+    entry->loaded = 0;
+  pthread_mutex_unlock(&stat_cache.lock);
+}
+
+// Checksum of path from start up to end (-1 for the end of the file),
+// from the digest cache when the file hasn't changed since.
+bool file_digest(const char *path, DigestType type, off_t start, off_t end,
+                 char *hex, off_t *size) {
+  struct stat file_stat;
+  int file_fd = open(path, O_RDONLY);
+
+  if (file_fd == -1 || fstat(file_fd, &file_stat) == -1 ||
+      !S_ISREG(file_stat.st_mode)) {
+    if (file_fd != -1)
+      close(file_fd);
+    return false;
+  }
+  *size = file_stat.st_size;
+
+  unsigned int hash = hash_path(path) ^ (type * 31 + start * 17 + end);
+  DigestCacheEntry *entry = &digest_cache.entries[hash % DIGEST_CACHE_SIZE];
+  pthread_mutex_lock(&digest_cache.lock);
+  if (strcmp(entry->path, path) == 0 && entry->type == type &&
+      entry->start == start && entry->end == end &&
+      entry->size == file_stat.st_size &&
+      entry->mtime.tv_sec == file_stat.st_mtim.tv_sec &&
+      entry->mtime.tv_nsec == file_stat.st_mtim.tv_nsec) {
+    memcpy(hex, entry->hex, DIGEST_HEX_SIZE);
+    digest_cache.hits++;
+    pthread_mutex_unlock(&digest_cache.lock);
+    close(file_fd);
+    return true;
+  }
+  digest_cache.misses++;
+  pthread_mutex_unlock(&digest_cache.lock);
+
+  bool ok = digest_file(type, file_fd, start, end, hex);
+  close(file_fd);
+  if (!ok)
+    return false;
+
+  pthread_mutex_lock(&digest_cache.lock);
+  snprintf(entry->path, sizeof(entry->path), "%s", path);
+  entry->type = type;
+  entry->start = start;
+  entry->end = end;
+  entry->size = file_stat.st_size;
+  entry->mtime = file_stat.st_mtim;
+  memcpy(entry->hex, hex, DIGEST_HEX_SIZE);
+  log_debug(LOG_DIGEST, digest_name(type), path, hex, digest_cache.hits,
+            digest_cache.misses);
+  pthread_mutex_unlock(&digest_cache.lock);
+  return true;
+}
+
+// Splits "file [start [end]]", a file name may contain spaces and be
+// quoted. False if end is before start.
+bool parse_range(const char *arg, char *name, off_t *start, off_t *end) {
+  long long numbers[2];
+  int count = 0;
+  char *space;
+
+  snprintf(name, MAX_PATH, "%s", arg);
+  while (count < 2 && (space = strrchr(name, ' ')) != NULL) {
+    char *rest;
+    long long value = strtoll(space + 1, &rest, 10);
+    if (space[1] == '\0' || *rest != '\0' || value < 0)
+      break;
+    numbers[count++] = value;
+    *space = '\0';
+  }
+  *start = count == 2 ? numbers[1] : count == 1 ? numbers[0] : 0;
+  *end = count == 2 ? numbers[0] : -1;
+
+  size_t len = strlen(name);
+  if (len >= 2 && name[0] == '"' && name[len - 1] == '"') {
+    memmove(name, name + 1, len - 2);
+    name[len - 2] = '\0';
+  }
+  return name[0] != '\0' && (*end == -1 || *end >= *start);
 }
 
 void get_local_ip() {
@@ -638,7 +3929,7 @@ void get_local_ip() {
   char host[NI_MAXHOST];
 
   if (getifaddrs(&ifaddr) == -1) {
-    perror("getifaddrs");
+    log_perror("getifaddrs");
     exit(EXIT_FAILURE);
   }
 
@@ -652,7 +3943,7 @@ void get_local_ip() {
       s = getnameinfo(ifa->ifa_addr, sizeof(struct sockaddr_in), host,
                       NI_MAXHOST, NULL, 0, NI_NUMERICHOST);
       if (s != 0) {
-        printf("getnameinfo() failed: %s\n", gai_strerror(s));
+        log_error("getnameinfo() failed: %s", gai_strerror(s));
         exit(EXIT_FAILURE);
       }
 
@@ -667,7 +3958,7 @@ void get_local_ip() {
   freeifaddrs(ifaddr);
 
   if (server_ip[0] == '\0') {
-    fprintf(stderr, "Could not find a suitable network interface\n");
+    log_error("Could not find a suitable network interface");
     exit(EXIT_FAILURE);
   }
 }
\ No newline at end of file
@@ -0,0 +1,209 @@
+/*  log.c
+ *   Lock-free ring buffer logger with a background flusher, see log.h.
+ *
+ *   The ring is a bounded multi-producer queue: every slot carries a
+ *   sequence number, a producer claims the slot at enqueue_pos with a CAS
+ *   and publishes it by advancing the slot's sequence, the flusher thread
+ *   consumes slots in order and hands them back one lap ahead.
+ */
+#define _GNU_SOURCE
+#include "log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_RING_SIZE 1024 // power of two
+#define LOG_TEXT_SIZE 512
+#define LOG_COMMAND_SIZE 8
+#define LOG_IDLE_NS (10 * 1000 * 1000)
+
+typedef struct {
+  atomic_size_t sequence;
+  LogLevel level;
+  struct timespec time;
+  unsigned long session;
+  char command[LOG_COMMAND_SIZE];
+  long long bytes;
+  double seconds;
+  char text[LOG_TEXT_SIZE];
+} LogRecord;
+
+static LogRecord ring[LOG_RING_SIZE];
+static atomic_size_t enqueue_pos;
+static atomic_size_t dequeue_pos;
+static atomic_ulong dropped;
+static LogLevel min_level = LOG_LEVEL_INFO;
+static bool started = false;
+
+static __thread unsigned long context_session;
+static __thread const char *context_command;
+
+static const char *level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static void *log_thread(void *arg);
+static void log_format(FILE *out, LogRecord *record);
+
+void log_init() {
+  const char *level = getenv("LOG_LEVEL");
+  if (level != NULL) {
+    for (int i = LOG_LEVEL_DEBUG; i <= LOG_LEVEL_ERROR; i++) {
+      if (strcasecmp(level, level_names[i]) == 0)
+        min_level = i;
+    }
+  }
+
+  for (size_t i = 0; i < LOG_RING_SIZE; i++)
+    atomic_init(&ring[i].sequence, i);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, log_thread, NULL) != 0) {
+    perror("log thread");
+    exit(EXIT_FAILURE);
+  }
+  pthread_detach(thread);
+  started = true;
+  atexit(log_flush);
+}
+
+// Waits (briefly) for the flusher to write what is queued, for shutdown.
+void log_flush() {
+  for (int i = 0; started && i < 100; i++) {
+    if (atomic_load(&dequeue_pos) == atomic_load(&enqueue_pos))
+      break;
+    usleep(1000);
+  }
+  fflush(stdout);
+}
+
+void log_set_context(unsigned long session, const char *command) {
+  context_session = session;
+  context_command = command;
+}
+
+void log_write(LogLevel level, long long bytes, double seconds,
+               const char *format, ...) {
+  if (level < min_level)
+    return;
+
+  if (!started) { // before log_init(), write synchronously
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    putchar('\n');
+    return;
+  }
+
+  LogRecord *record;
+  size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+  while (1) {
+    record = &ring[pos & (LOG_RING_SIZE - 1)];
+    size_t sequence =
+        atomic_load_explicit(&record->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      // full, the flusher is behind: drop instead of waiting
+      atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+      return;
+    } else {
+      pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    }
+  }
+
+  record->level = level;
+  clock_gettime(CLOCK_REALTIME, &record->time);
+  record->session = context_session;
+  snprintf(record->command, LOG_COMMAND_SIZE, "%s",
+           context_command ? context_command : "");
+  record->bytes = bytes;
+  record->seconds = seconds;
+
+  va_list args;
+  va_start(args, format);
+  vsnprintf(record->text, LOG_TEXT_SIZE, format, args);
+  va_end(args);
+
+  atomic_store_explicit(&record->sequence, pos + 1, memory_order_release);
+}
+
+void log_perror(const char *message) {
+  char buffer[128];
+  log_error("%s: %s", message, strerror_r(errno, buffer, sizeof(buffer)));
+}
+
+static void *log_thread(void *arg) {
+  struct timespec idle = {0, LOG_IDLE_NS};
+  size_t pos = 0;
+
+  while (1) {
+    LogRecord *record = &ring[pos & (LOG_RING_SIZE - 1)];
+    size_t sequence =
+        atomic_load_explicit(&record->sequence, memory_order_acquire);
+
+    if (sequence != pos + 1) {
+      // nothing queued: push out what stdio buffered and wait a bit
+      unsigned long lost = atomic_exchange(&dropped, 0);
+      if (lost > 0)
+        printf("log: %lu messages dropped\n", lost);
+      fflush(stdout);
+      nanosleep(&idle, NULL);
+      continue;
+    }
+
+    log_format(stdout, record);
+    atomic_store_explicit(&record->sequence, pos + LOG_RING_SIZE,
+                          memory_order_release);
+    pos++;
+    atomic_store(&dequeue_pos, pos);
+  }
+  return NULL;
+}
+
+static void log_format(FILE *out, LogRecord *record) {
+  struct tm tm_info;
+  char time_buffer[32];
+
+  localtime_r(&record->time.tv_sec, &tm_info);
+  strftime(time_buffer, sizeof(time_buffer), "%H:%M:%S", &tm_info);
+  fprintf(out, "%s.%03ld %-5s ", time_buffer, record->time.tv_nsec / 1000000,
+          level_names[record->level]);
+
+  if (record->session || record->command[0] || record->bytes >= 0 ||
+      record->seconds >= 0) {
+    const char *separator = "";
+    fputc('[', out);
+    if (record->session) {
+      fprintf(out, "s%lu", record->session);
+      separator = " ";
+    }
+    if (record->command[0]) {
+      fprintf(out, "%s%s", separator, record->command);
+      separator = " ";
+    }
+    if (record->bytes >= 0) {
+      fprintf(out, "%sbytes=%lld", separator, record->bytes);
+      separator = " ";
+    }
+    if (record->seconds >= 0)
+      fprintf(out, "%stime=%.3fms", separator, record->seconds * 1e3);
+    fputs("] ", out);
+  }
+
+  fputs(record->text, out);
+  fputc('\n', out);
+}
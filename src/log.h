@@ -0,0 +1,42 @@
+/*  log.h
+ *   Asynchronous logger shared by ftp_server and telnet_server.
+ *
+ *   log_write() formats the message into a slot of a lock-free ring buffer
+ *   and returns, a background thread writes the ring to stdout. When the
+ *   ring is full the message is dropped (and counted) rather than blocking
+ *   the caller, so a slow terminal or pipe never stalls a transfer.
+ *
+ *   The minimum level is read from the LOG_LEVEL environment variable
+ *   (debug, info, warn or error), info by default.
+ */
+#ifndef LOG_H
+#define LOG_H
+
+typedef enum {
+  LOG_LEVEL_DEBUG,
+  LOG_LEVEL_INFO,
+  LOG_LEVEL_WARN,
+  LOG_LEVEL_ERROR
+} LogLevel;
+
+void log_init();
+void log_flush();
+
+// Session id and command attached to every message of the calling thread,
+// 0 / NULL to clear them.
+void log_set_context(unsigned long session, const char *command);
+
+// bytes and seconds are optional structured fields, -1 leaves them out
+void log_write(LogLevel level, long long bytes, double seconds,
+               const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+// Like perror(), at error level
+void log_perror(const char *message);
+
+#define log_debug(...) log_write(LOG_LEVEL_DEBUG, -1, -1, __VA_ARGS__)
+#define log_info(...) log_write(LOG_LEVEL_INFO, -1, -1, __VA_ARGS__)
+#define log_warn(...) log_write(LOG_LEVEL_WARN, -1, -1, __VA_ARGS__)
+#define log_error(...) log_write(LOG_LEVEL_ERROR, -1, -1, __VA_ARGS__)
+
+#endif
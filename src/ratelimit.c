@@ -0,0 +1,167 @@
+/*  ratelimit.c
+ *   Token buckets, see ratelimit.h.
+ *
+ *   Buckets refill continuously at their rate up to a quarter of a second
+ *   worth of tokens and go into debt when charged more than they hold. A
+ *   charge waits until the deepest debt it added to is paid back, so the
+ *   bytes moved over any stretch of time never exceed the rate plus the
+ *   burst.
+ */
+#define _GNU_SOURCE
+#include "ratelimit.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+
+#define RATE_BURST_DIVISOR 4    // burst of a quarter of a second
+#define RATE_QUANTUM_DIVISOR 20 // quantum of 50ms
+#define RATE_QUANTUM_MIN 4096
+#define RATE_QUANTUM_MAX (256 * 1024)
+
+static RateBucket global;
+static double ip_rate = 0, session_rate = 0;
+
+// per IP buckets in use
+static RateBucket *ip_buckets = NULL;
+static pthread_mutex_t ip_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static double env_rate(const char *prefix, const char *suffix) {
+  char name[64];
+  snprintf(name, sizeof(name), "%s%s", prefix, suffix);
+  const char *value = getenv(name);
+  long long kbytes = value != NULL ? atoll(value) : 0;
+
+  return kbytes > 0 ? kbytes * 1024.0 : 0;
+}
+
+static void bucket_init(RateBucket *bucket, double rate) {
+  pthread_mutex_init(&bucket->lock, NULL);
+  bucket->rate = rate;
+  bucket->burst = rate / RATE_BURST_DIVISOR;
+  bucket->tokens = bucket->burst;
+  bucket->last = now_ns();
+}
+
+// Charges bytes, returns the nanoseconds until the bucket is out of debt
+static long long bucket_charge(RateBucket *bucket, size_t bytes) {
+  long long wait = 0;
+
+  if (bucket->rate == 0)
+    return 0;
+  pthread_mutex_lock(&bucket->lock);
+  long long now = now_ns();
+  bucket->tokens += bucket->rate * (now - bucket->last) / 1e9;
+  if (bucket->tokens > bucket->burst)
+    bucket->tokens = bucket->burst;
+  bucket->last = now;
+  bucket->tokens -= bytes;
+  if (bucket->tokens < 0)
+    wait = -bucket->tokens / bucket->rate * 1e9;
+  pthread_mutex_unlock(&bucket->lock);
+  return wait;
+}
+
+static size_t bucket_quantum(RateBucket *bucket, size_t want) {
+  size_t quantum;
+
+  if (bucket == NULL || bucket->rate == 0)
+    return want;
+  quantum = bucket->rate / RATE_QUANTUM_DIVISOR;
+  if (quantum < RATE_QUANTUM_MIN)
+    quantum = RATE_QUANTUM_MIN;
+  if (quantum > RATE_QUANTUM_MAX)
+    quantum = RATE_QUANTUM_MAX;
+  return want < quantum ? want : quantum;
+}
+
+void rate_init(const char *prefix) {
+  bucket_init(&global, env_rate(prefix, "_RATE"));
+  ip_rate = env_rate(prefix, "_IP_RATE");
+  session_rate = env_rate(prefix, "_SESSION_RATE");
+  if (rate_enabled())
+    log_info("Rate caps in KB/s (0 for none): %.0f total, %.0f per IP, "
+             "%.0f per session",
+             global.rate / 1024, ip_rate / 1024, session_rate / 1024);
+}
+
+bool rate_enabled() {
+  return global.rate > 0 || ip_rate > 0 || session_rate > 0;
+}
+
+void rate_open(RateLimit *limit, const char *ip) {
+  bucket_init(&limit->session, session_rate);
+  limit->ip = NULL;
+  if (ip_rate == 0)
+    return;
+
+  pthread_mutex_lock(&ip_lock);
+  RateBucket *bucket = ip_buckets;
+  while (bucket != NULL && strcmp(bucket->ip, ip) != 0)
+    bucket = bucket->next;
+  if (bucket == NULL && (bucket = calloc(1, sizeof(RateBucket))) != NULL) {
+    bucket_init(bucket, ip_rate);
+    snprintf(bucket->ip, sizeof(bucket->ip), "%s", ip);
+    bucket->next = ip_buckets;
+    ip_buckets = bucket;
+  }
+  if (bucket != NULL)
+    bucket->refs++;
+  else
+    log_error("No memory for the rate cap of %s", ip);
+  limit->ip = bucket;
+  pthread_mutex_unlock(&ip_lock);
+}
+
+void rate_close(RateLimit *limit) {
+  pthread_mutex_destroy(&limit->session.lock);
+  if (limit->ip == NULL)
+    return;
+
+  pthread_mutex_lock(&ip_lock);
+  if (--limit->ip->refs == 0) {
+    RateBucket **link = &ip_buckets;
+    while (*link != limit->ip)
+      link = &(*link)->next;
+    *link = limit->ip->next;
+    pthread_mutex_destroy(&limit->ip->lock);
+    free(limit->ip);
+  }
+  pthread_mutex_unlock(&ip_lock);
+  limit->ip = NULL;
+}
+
+size_t rate_quantum(RateLimit *limit, size_t want) {
+  want = bucket_quantum(&global, want);
+  want = bucket_quantum(limit->ip, want);
+  return bucket_quantum(&limit->session, want);
+}
+
+long long rate_charge(RateLimit *limit, size_t bytes, bool interactive) {
+  long long wait = bucket_charge(&global, bytes);
+  long long other;
+
+  if (limit->ip != NULL && (other = bucket_charge(limit->ip, bytes)) > wait)
+    wait = other;
+  if ((other = bucket_charge(&limit->session, bytes)) > wait)
+    wait = other;
+  return interactive && bytes <= RATE_INTERACTIVE ? 0 : wait;
+}
+
+void rate_wait(RateLimit *limit, size_t bytes) {
+  long long wait = rate_charge(limit, bytes, false);
+  struct timespec delay = {wait / 1000000000LL, wait % 1000000000LL};
+
+  while (wait > 0 && nanosleep(&delay, &delay) == -1 && errno == EINTR)
+    ;
+}
@@ -0,0 +1,64 @@
+/*  ratelimit.h
+ *   Bandwidth caps shared by ftp_server and telnet_server: token buckets
+ *   for the whole server, for every client IP and for every session.
+ *
+ *   <PREFIX>_RATE, <PREFIX>_IP_RATE and <PREFIX>_SESSION_RATE set the caps
+ *   in KB/s, none by default. A transfer moves at most rate_quantum() bytes
+ *   at a time and pays for what it moved with rate_charge(), which takes
+ *   the bytes from every bucket it draws from and waits off any debt. All
+ *   the transfers over a bucket queue behind its debt in turn, so they get
+ *   even shares of the cap and a transfer held back by a cap of its own
+ *   leaves the rest of the bandwidth to the others.
+ *
+ *   Interactive writes of up to RATE_INTERACTIVE bytes are paid for but
+ *   never wait: keystrokes and their echo get through even when bulk
+ *   transfers keep the buckets in debt. The caller tells which writes are
+ *   interactive, bulk data moved in small pieces waits like any other.
+ */
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define RATE_INTERACTIVE 512
+
+typedef struct RateBucket {
+  pthread_mutex_t lock;
+  double rate;    // bytes per second, 0 for no cap
+  double burst;   // most tokens saved up while idle
+  double tokens;  // negative while in debt
+  long long last; // refilled up to, monotonic ns
+  // the per IP buckets are shared by the sessions of the IP
+  struct RateBucket *next;
+  char ip[INET6_ADDRSTRLEN];
+  int refs;
+} RateBucket;
+
+// The buckets a session draws from
+typedef struct {
+  RateBucket session;
+  RateBucket *ip; // NULL without an IP cap
+} RateLimit;
+
+// Reads the caps from the environment variables of prefix
+void rate_init(const char *prefix);
+
+// Whether any cap is set
+bool rate_enabled();
+
+void rate_open(RateLimit *limit, const char *ip);
+void rate_close(RateLimit *limit);
+
+// Most of want to move before paying for it
+size_t rate_quantum(RateLimit *limit, size_t want);
+
+// Pays for bytes moved, returns the nanoseconds to wait before moving more
+long long rate_charge(RateLimit *limit, size_t bytes, bool interactive);
+
+// rate_charge() of bulk data and the wait
+void rate_wait(RateLimit *limit, size_t bytes);
+
+#endif
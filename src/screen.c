@@ -0,0 +1,920 @@
+/*  screen.c
+ *   VT100/ANSI terminal model and frame renderer, see screen.h.
+ *
+ *   The terminal follows xterm for what full screen programs use: cursor
+ *   movement and addressing, erasing, inserting and deleting characters and
+ *   lines, scroll regions, SGR attributes with 16 colors, the alternate
+ *   screen and DEC line drawing. Other sequences are parsed and dropped.
+ *
+ *   The client is kept in a known state: autowrap off, so writing the last
+ *   column never scrolls, the scroll region the whole screen and G0 in use.
+ *   A region that scrolled is scrolled on the client with line feeds at its
+ *   bottom or reverse indexes at its top under a scroll region set for the
+ *   time, the rows are then compared as usual. A frame
+ *   goes over the rows and sends each from the first cell that changed to
+ *   the last. It stops at a cell when the room runs out, the next frame
+ *   picks up from there.
+ */
+#include "screen.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ATTR_BOLD 1
+#define ATTR_UNDERLINE 2
+#define ATTR_BLINK 4
+#define ATTR_REVERSE 8
+#define ATTR_GRAPHICS 16 // DEC line drawing
+
+#define COLOR_DEFAULT 255
+
+#define MODE_WRAP 1
+#define MODE_INSERT 2
+#define MODE_CURSOR 4 // visible
+#define MODE_APP_CURSOR 8
+#define MODE_APP_KEYPAD 16
+#define MODE_ALT 32
+// what the client is told about, the rest only matters to the model
+#define CLIENT_MODES (MODE_CURSOR | MODE_APP_CURSOR | MODE_APP_KEYPAD)
+
+#define CELL_WORST 48 // a cursor move, the attributes and the character
+
+enum { S_GROUND, S_ESC, S_CSI, S_CHARSET, S_SKIP, S_STRING };
+
+typedef struct {
+  uint8_t *data;
+  size_t len;
+  size_t room;
+} Out;
+
+static const Cell blank = {' ', 0, COLOR_DEFAULT, COLOR_DEFAULT};
+
+static bool cell_equal(Cell a, Cell b) {
+  return a.ch == b.ch && a.attr == b.attr && a.fg == b.fg && a.bg == b.bg;
+}
+
+static bool pen_equal(Cell a, Cell b) {
+  return a.attr == b.attr && a.fg == b.fg && a.bg == b.bg;
+}
+
+static void fill(Cell *cells, int count, Cell cell) {
+  for (int i = 0; i < count; i++)
+    cells[i] = cell;
+}
+
+static bool all_blank(const Cell *cells, int count) {
+  for (int i = 0; i < count; i++)
+    if (!cell_equal(cells[i], blank))
+      return false;
+  return true;
+}
+
+static Cell *row(Screen *screen, int y) {
+  return screen->cells + y * screen->width;
+}
+
+// Erased cells take the background of the pen, like xterm
+static Cell erased(Screen *screen) {
+  Cell cell = blank;
+  cell.bg = screen->pen.bg;
+  return cell;
+}
+
+static int clamp(int value, int low, int high) {
+  return value < low ? low : value > high ? high : value;
+}
+
+static void move_to(Screen *screen, int x, int y) {
+  screen->x = clamp(x, 0, screen->width - 1);
+  screen->y = clamp(y, 0, screen->height - 1);
+  screen->wrap = false;
+}
+
+// Scrolls of other regions than the first are left to the row compare
+static void note_scroll(Screen *screen, int top, int bottom, int count) {
+  if (screen->scrolled == 0) {
+    screen->scroll_top = top;
+    screen->scroll_bottom = bottom;
+  }
+  if (top == screen->scroll_top && bottom == screen->scroll_bottom)
+    screen->scrolled += count;
+}
+
+static void scroll_up(Screen *screen, int top, int bottom, int count) {
+  int width = screen->width, rows = bottom - top + 1;
+
+  count = clamp(count, 0, rows);
+  memmove(row(screen, top), row(screen, top + count),
+          (rows - count) * width * sizeof(Cell));
+  fill(row(screen, bottom - count + 1), count * width, erased(screen));
+  note_scroll(screen, top, bottom, count);
+}
+
+static void scroll_down(Screen *screen, int top, int bottom, int count) {
+  int width = screen->width, rows = bottom - top + 1;
+
+  count = clamp(count, 0, rows);
+  memmove(row(screen, top + count), row(screen, top),
+          (rows - count) * width * sizeof(Cell));
+  fill(row(screen, top), count * width, erased(screen));
+  note_scroll(screen, top, bottom, -count);
+}
+
+static void line_feed(Screen *screen) {
+  screen->wrap = false;
+  if (screen->y == screen->bottom)
+    scroll_up(screen, screen->top, screen->bottom, 1);
+  else if (screen->y < screen->height - 1)
+    screen->y++;
+}
+
+static void reverse_index(Screen *screen) {
+  screen->wrap = false;
+  if (screen->y == screen->top)
+    scroll_down(screen, screen->top, screen->bottom, 1);
+  else if (screen->y > 0)
+    screen->y--;
+}
+
+static void put(Screen *screen, uint8_t ch) {
+  if (screen->wrap) {
+    screen->x = 0;
+    line_feed(screen);
+  }
+
+  Cell *line = row(screen, screen->y);
+  int x = screen->x;
+  if (screen->modes & MODE_INSERT)
+    memmove(line + x + 1, line + x, (screen->width - x - 1) * sizeof(Cell));
+  line[x] = screen->pen;
+  line[x].ch = ch;
+  if (screen->graphics[screen->charset])
+    line[x].attr |= ATTR_GRAPHICS;
+
+  if (x < screen->width - 1)
+    screen->x++;
+  else
+    screen->wrap = (screen->modes & MODE_WRAP) != 0;
+}
+
+static void erase_display(Screen *screen, int mode) {
+  int at = screen->y * screen->width + screen->x;
+  int total = screen->width * screen->height;
+
+  if (mode == 0)
+    fill(screen->cells + at, total - at, erased(screen));
+  else if (mode == 1)
+    fill(screen->cells, at + 1, erased(screen));
+  else
+    fill(screen->cells, total, erased(screen));
+}
+
+static void erase_line(Screen *screen, int mode) {
+  Cell *line = row(screen, screen->y);
+
+  if (mode == 0)
+    fill(line + screen->x, screen->width - screen->x, erased(screen));
+  else if (mode == 1)
+    fill(line, screen->x + 1, erased(screen));
+  else
+    fill(line, screen->width, erased(screen));
+}
+
+static void save_cursor(Screen *screen) {
+  screen->saved_x = screen->x;
+  screen->saved_y = screen->y;
+  screen->saved_pen = screen->pen;
+}
+
+static void restore_cursor(Screen *screen) {
+  move_to(screen, screen->saved_x, screen->saved_y);
+  screen->pen = screen->saved_pen;
+}
+
+static void alt_screen(Screen *screen, bool on, bool clear) {
+  if (on == ((screen->modes & MODE_ALT) != 0))
+    return;
+  screen->modes ^= MODE_ALT;
+  screen->cells = on ? screen->alt : screen->main;
+  if (on && clear)
+    fill(screen->alt, screen->width * screen->height, blank);
+  screen->scrolled = 0;
+}
+
+static void reset(Screen *screen) {
+  alt_screen(screen, false, false);
+  screen->modes = MODE_WRAP | MODE_CURSOR;
+  screen->pen = blank;
+  screen->graphics[0] = screen->graphics[1] = false;
+  screen->charset = 0;
+  screen->top = 0;
+  screen->bottom = screen->height - 1;
+  move_to(screen, 0, 0);
+  save_cursor(screen);
+  erase_display(screen, 2);
+}
+
+static void answer(Screen *screen, const char *format, ...) {
+  size_t room = sizeof(screen->answer) - screen->answer_len;
+  va_list args;
+
+  va_start(args, format);
+  int len = vsnprintf((char *)screen->answer + screen->answer_len, room,
+                      format, args);
+  va_end(args);
+  if (len > 0 && (size_t)len < room)
+    screen->answer_len += len;
+}
+
+static int param(Screen *screen, int i, int fallback) {
+  return i < screen->param_count && screen->params[i] > 0 ? screen->params[i]
+                                                          : fallback;
+}
+
+// 38;5;n and 38;2;r;g;b, only the 16 colors are kept
+static uint8_t extended_color(Screen *screen, int *i) {
+  int kind = *i + 1 < screen->param_count ? screen->params[*i + 1] : 0;
+
+  if (kind == 5 && *i + 2 < screen->param_count) {
+    int color = screen->params[*i + 2];
+    *i += 2;
+    return color < 16 ? color : COLOR_DEFAULT;
+  }
+  if (kind == 2)
+    *i += 4;
+  return COLOR_DEFAULT;
+}
+
+static void select_graphic_rendition(Screen *screen) {
+  Cell *pen = &screen->pen;
+
+  if (screen->param_count == 0)
+    *pen = blank;
+  for (int i = 0; i < screen->param_count; i++) {
+    int code = screen->params[i];
+    if (code == 0)
+      *pen = blank;
+    else if (code == 1)
+      pen->attr |= ATTR_BOLD;
+    else if (code == 4)
+      pen->attr |= ATTR_UNDERLINE;
+    else if (code == 5)
+      pen->attr |= ATTR_BLINK;
+    else if (code == 7)
+      pen->attr |= ATTR_REVERSE;
+    else if (code == 22)
+      pen->attr &= ~ATTR_BOLD;
+    else if (code == 24)
+      pen->attr &= ~ATTR_UNDERLINE;
+    else if (code == 25)
+      pen->attr &= ~ATTR_BLINK;
+    else if (code == 27)
+      pen->attr &= ~ATTR_REVERSE;
+    else if (code >= 30 && code <= 37)
+      pen->fg = code - 30;
+    else if (code == 38)
+      pen->fg = extended_color(screen, &i);
+    else if (code == 39)
+      pen->fg = COLOR_DEFAULT;
+    else if (code >= 40 && code <= 47)
+      pen->bg = code - 40;
+    else if (code == 48)
+      pen->bg = extended_color(screen, &i);
+    else if (code == 49)
+      pen->bg = COLOR_DEFAULT;
+    else if (code >= 90 && code <= 97)
+      pen->fg = code - 90 + 8;
+    else if (code >= 100 && code <= 107)
+      pen->bg = code - 100 + 8;
+  }
+}
+
+static void set_mode(Screen *screen, int mode, bool on) {
+  uint8_t flag = 0;
+
+  if (screen->private == 0) {
+    if (mode == 4)
+      flag = MODE_INSERT;
+  } else if (mode == 1) {
+    flag = MODE_APP_CURSOR;
+  } else if (mode == 7) {
+    flag = MODE_WRAP;
+    screen->wrap = false;
+  } else if (mode == 25) {
+    flag = MODE_CURSOR;
+  } else if (mode == 47 || mode == 1047) {
+    alt_screen(screen, on, mode == 1047);
+  } else if (mode == 1048) {
+    on ? save_cursor(screen) : restore_cursor(screen);
+  } else if (mode == 1049) {
+    if (on) {
+      save_cursor(screen);
+      alt_screen(screen, true, true);
+    } else {
+      alt_screen(screen, false, false);
+      restore_cursor(screen);
+    }
+  }
+  if (on)
+    screen->modes |= flag;
+  else
+    screen->modes &= ~flag;
+}
+
+static void csi_dispatch(Screen *screen, uint8_t final) {
+  int count = param(screen, 0, 1);
+  int x = screen->x, y = screen->y;
+  int width = screen->width, height = screen->height;
+  Cell *line = row(screen, y);
+
+  if (screen->intermediate != 0)
+    return;
+  if (final == 'h' || final == 'l') {
+    for (int i = 0; i < screen->param_count; i++)
+      set_mode(screen, screen->params[i], final == 'h');
+    return;
+  }
+  if (screen->private != 0)
+    return;
+
+  switch (final) {
+  case '@':
+    count = clamp(count, 0, width - x);
+    memmove(line + x + count, line + x, (width - x - count) * sizeof(Cell));
+    fill(line + x, count, erased(screen));
+    break;
+  case 'A':
+    move_to(screen, x, y - count < screen->top && y >= screen->top
+                           ? screen->top
+                           : y - count);
+    break;
+  case 'B':
+  case 'e':
+    move_to(screen, x, y + count > screen->bottom && y <= screen->bottom
+                           ? screen->bottom
+                           : y + count);
+    break;
+  case 'C':
+  case 'a':
+    move_to(screen, x + count, y);
+    break;
+  case 'D':
+    move_to(screen, x - count, y);
+    break;
+  case 'E':
+    move_to(screen, 0, y + count);
+    break;
+  case 'F':
+    move_to(screen, 0, y - count);
+    break;
+  case 'G':
+  case '`':
+    move_to(screen, count - 1, y);
+    break;
+  case 'd':
+    move_to(screen, x, count - 1);
+    break;
+  case 'H':
+  case 'f':
+    move_to(screen, param(screen, 1, 1) - 1, count - 1);
+    break;
+  case 'J':
+    erase_display(screen, param(screen, 0, 0));
+    break;
+  case 'K':
+    erase_line(screen, param(screen, 0, 0));
+    break;
+  case 'L':
+    if (y >= screen->top && y <= screen->bottom) {
+      scroll_down(screen, y, screen->bottom, count);
+      move_to(screen, 0, y);
+    }
+    break;
+  case 'M':
+    if (y >= screen->top && y <= screen->bottom) {
+      scroll_up(screen, y, screen->bottom, count);
+      move_to(screen, 0, y);
+    }
+    break;
+  case 'P':
+    count = clamp(count, 0, width - x);
+    memmove(line + x, line + x + count, (width - x - count) * sizeof(Cell));
+    fill(line + width - count, count, erased(screen));
+    break;
+  case 'X':
+    fill(line + x, clamp(count, 0, width - x), erased(screen));
+    break;
+  case 'S':
+    scroll_up(screen, screen->top, screen->bottom, count);
+    break;
+  case 'T':
+    if (screen->param_count <= 1) // with more it is mouse tracking
+      scroll_down(screen, screen->top, screen->bottom, count);
+    break;
+  case 'm':
+    select_graphic_rendition(screen);
+    break;
+  case 'r': {
+    int top = param(screen, 0, 1) - 1, bottom = param(screen, 1, height) - 1;
+    if (top < bottom && bottom < height) {
+      screen->top = top;
+      screen->bottom = bottom;
+      move_to(screen, 0, 0);
+    }
+    break;
+  }
+  case 's':
+    save_cursor(screen);
+    break;
+  case 'u':
+    restore_cursor(screen);
+    break;
+  case 'n':
+    if (param(screen, 0, 0) == 5)
+      answer(screen, "\033[0n");
+    else if (param(screen, 0, 0) == 6)
+      answer(screen, "\033[%d;%dR", y + 1, x + 1);
+    break;
+  case 'c':
+    if (param(screen, 0, 0) == 0)
+      answer(screen, "\033[?1;2c"); // VT100 with advanced video
+    break;
+  }
+}
+
+static void csi_byte(Screen *screen, uint8_t byte) {
+  if (byte >= '0' && byte <= '9') {
+    if (screen->param_count == 0)
+      screen->param_count = 1;
+    int *value = &screen->params[screen->param_count - 1];
+    if (*value < 10000)
+      *value = *value * 10 + byte - '0';
+  } else if (byte == ';' || byte == ':') {
+    if (screen->param_count == 0)
+      screen->param_count = 1;
+    if (screen->param_count < SCREEN_PARAMS)
+      screen->param_count++;
+  } else if (byte >= '<' && byte <= '?') {
+    screen->private = byte;
+  } else if (byte >= 0x20 && byte <= 0x2f) {
+    screen->intermediate = byte;
+  } else {
+    screen->state = S_GROUND;
+    if (byte >= 0x40 && byte <= 0x7e)
+      csi_dispatch(screen, byte);
+  }
+}
+
+static void esc_dispatch(Screen *screen, uint8_t byte) {
+  screen->state = S_GROUND;
+  switch (byte) {
+  case '[':
+    screen->state = S_CSI;
+    screen->private = 0;
+    screen->intermediate = 0;
+    screen->param_count = 0;
+    memset(screen->params, 0, sizeof(screen->params));
+    break;
+  case ']': // OSC, DCS, SOS, PM and APC strings are skipped
+  case 'P':
+  case 'X':
+  case '^':
+  case '_':
+    screen->state = S_STRING;
+    break;
+  case '(':
+  case ')':
+    screen->intermediate = byte;
+    screen->state = S_CHARSET;
+    break;
+  case '*':
+  case '+':
+  case '#':
+  case '%':
+  case ' ':
+    screen->state = S_SKIP;
+    break;
+  case '7':
+    save_cursor(screen);
+    break;
+  case '8':
+    restore_cursor(screen);
+    break;
+  case 'D':
+    line_feed(screen);
+    break;
+  case 'E':
+    screen->x = 0;
+    line_feed(screen);
+    break;
+  case 'M':
+    reverse_index(screen);
+    break;
+  case 'c':
+    reset(screen);
+    break;
+  case '=':
+    screen->modes |= MODE_APP_KEYPAD;
+    break;
+  case '>':
+    screen->modes &= ~MODE_APP_KEYPAD;
+    break;
+  }
+}
+
+// C0 controls act in the middle of escape sequences too
+static void control(Screen *screen, uint8_t byte) {
+  if (byte == 0x1b) {
+    screen->state = S_ESC;
+    return;
+  }
+  if (byte == 0x18 || byte == 0x1a) { // CAN, SUB
+    screen->state = S_GROUND;
+    return;
+  }
+  if (screen->state == S_STRING) {
+    if (byte == '\a')
+      screen->state = S_GROUND;
+    return;
+  }
+
+  switch (byte) {
+  case '\a':
+    screen->bell = true;
+    break;
+  case '\b':
+    move_to(screen, screen->x - 1, screen->y);
+    break;
+  case '\t':
+    move_to(screen, (screen->x / 8 + 1) * 8, screen->y);
+    break;
+  case '\n':
+  case '\v':
+  case '\f':
+    line_feed(screen);
+    break;
+  case '\r':
+    move_to(screen, 0, screen->y);
+    break;
+  case 0x0e: // SO
+    screen->charset = 1;
+    break;
+  case 0x0f: // SI
+    screen->charset = 0;
+    break;
+  }
+}
+
+void screen_write(Screen *screen, const uint8_t *data, size_t len) {
+  const uint8_t *end = data + len;
+
+  if (len > 0)
+    screen->changed = true;
+  while (data < end) {
+    uint8_t byte = *data++;
+    if (byte < 0x20) {
+      control(screen, byte);
+      continue;
+    }
+    if (byte == 0x7f)
+      continue;
+
+    switch (screen->state) {
+    case S_GROUND:
+      put(screen, byte);
+      break;
+    case S_ESC:
+      esc_dispatch(screen, byte);
+      break;
+    case S_CSI:
+      csi_byte(screen, byte);
+      break;
+    case S_CHARSET:
+      screen->graphics[screen->intermediate == ')'] = byte == '0';
+      screen->state = S_GROUND;
+      break;
+    case S_SKIP:
+      screen->state = S_GROUND;
+      break;
+    }
+  }
+}
+
+bool screen_changed(Screen *screen) {
+  return screen->changed;
+}
+
+static void out_write(Out *out, const char *text) {
+  size_t len = strlen(text);
+
+  memcpy(out->data + out->len, text, len);
+  out->len += len;
+}
+
+static void out_printf(Out *out, const char *format, ...) {
+  va_list args;
+
+  va_start(args, format);
+  int len = vsnprintf((char *)out->data + out->len, out->room - out->len,
+                      format, args);
+  va_end(args);
+  if (len > 0)
+    out->len += len;
+}
+
+static bool out_full(Out *out) {
+  return out->room - out->len < CELL_WORST;
+}
+
+// The shortest way there the client's cursor is known to take
+static void client_move(Screen *screen, Out *out, int x, int y) {
+  int from_x = screen->shown_x, from_y = screen->shown_y;
+
+  if (from_x == x && from_y == y)
+    return;
+  if (from_x >= 0 && from_y == y) {
+    if (x == 0)
+      out_write(out, "\r");
+    else if (x == from_x - 1)
+      out_write(out, "\b");
+    else if (x < from_x)
+      out_printf(out, "\033[%dD", from_x - x);
+    else
+      out_printf(out, "\033[%dC", x - from_x);
+  } else if (from_x >= 0 && y == from_y + 1 && x == 0) {
+    out_write(out, "\r\n");
+  } else if (x == 0 && y == 0) {
+    out_write(out, "\033[H");
+  } else if (x == 0) {
+    out_printf(out, "\033[%dH", y + 1);
+  } else {
+    out_printf(out, "\033[%d;%dH", y + 1, x + 1);
+  }
+  screen->shown_x = x;
+  screen->shown_y = y;
+}
+
+static void client_pen(Screen *screen, Out *out, Cell cell) {
+  Cell *pen = &screen->shown_pen;
+
+  if ((cell.attr ^ pen->attr) & ATTR_GRAPHICS)
+    out_write(out, cell.attr & ATTR_GRAPHICS ? "\033(0" : "\033(B");
+  if (((cell.attr ^ pen->attr) & ~ATTR_GRAPHICS) || cell.fg != pen->fg ||
+      cell.bg != pen->bg) {
+    out_write(out, "\033[0");
+    if (cell.attr & ATTR_BOLD)
+      out_write(out, ";1");
+    if (cell.attr & ATTR_UNDERLINE)
+      out_write(out, ";4");
+    if (cell.attr & ATTR_BLINK)
+      out_write(out, ";5");
+    if (cell.attr & ATTR_REVERSE)
+      out_write(out, ";7");
+    if (cell.fg != COLOR_DEFAULT)
+      out_printf(out, ";%d", cell.fg < 8 ? 30 + cell.fg : 90 + cell.fg - 8);
+    if (cell.bg != COLOR_DEFAULT)
+      out_printf(out, ";%d", cell.bg < 8 ? 40 + cell.bg : 100 + cell.bg - 8);
+    out_write(out, "m");
+  }
+  *pen = cell;
+}
+
+static void client_modes(Screen *screen, Out *out) {
+  uint8_t modes = screen->modes;
+  uint8_t changed = (modes ^ screen->shown_modes) & CLIENT_MODES;
+
+  if (changed & MODE_APP_CURSOR)
+    out_write(out, modes & MODE_APP_CURSOR ? "\033[?1h" : "\033[?1l");
+  if (changed & MODE_APP_KEYPAD)
+    out_write(out, modes & MODE_APP_KEYPAD ? "\033=" : "\033>");
+  if (changed & MODE_CURSOR)
+    out_write(out, modes & MODE_CURSOR ? "\033[?25h" : "\033[?25l");
+  screen->shown_modes = modes;
+}
+
+static void client_put(Screen *screen, Out *out, int x, int y) {
+  Cell cell = row(screen, y)[x];
+
+  client_move(screen, out, x, y);
+  client_pen(screen, out, cell);
+  out->data[out->len++] = cell.ch;
+  screen->shown[y * screen->width + x] = cell;
+  // where a client leaves the cursor after the last column varies
+  screen->shown_x = x + 1 < screen->width ? x + 1 : -1;
+}
+
+// Sends the cells of row y that changed, false when out of room
+static bool render_row(Screen *screen, Out *out, int y) {
+  int width = screen->width;
+  const Cell *want = row(screen, y);
+  Cell *have = screen->shown + y * width;
+
+  if (memcmp(want, have, width * sizeof(Cell)) == 0)
+    return true;
+
+  int last = width - 1;
+  while (cell_equal(want[last], have[last]))
+    last--;
+  // a blank tail of 4 cells or more is cheaper to erase than to write
+  int tail = width;
+  while (tail > 0 && cell_equal(want[tail - 1], blank))
+    tail--;
+  bool erase = last - tail >= 3;
+  int end = erase ? tail - 1 : last;
+
+  for (int x = 0; x <= end; x++) {
+    if (cell_equal(want[x], have[x])) {
+      // a few cells in the pen the client has are cheaper to write again
+      // than to move over
+      int run = x;
+      while (run <= end && cell_equal(want[run], have[run]))
+        run++;
+      bool rewrite = run <= end && run - x <= 4 && screen->shown_x == x &&
+                     screen->shown_y == y;
+      for (int i = x; rewrite && i < run; i++)
+        rewrite = pen_equal(want[i], screen->shown_pen);
+      if (!rewrite) {
+        x = run - 1;
+        continue;
+      }
+    }
+    if (out_full(out))
+      return false;
+    client_put(screen, out, x, y);
+  }
+
+  if (erase) {
+    if (out_full(out))
+      return false;
+    client_move(screen, out, tail, y);
+    client_pen(screen, out, blank);
+    out_write(out, "\033[K");
+    fill(have + tail, width - tail, blank);
+  }
+  return true;
+}
+
+// Scrolls the client's rows top to bottom by count, up when positive
+static void client_scroll(Screen *screen, Out *out, int top, int bottom,
+                          int count) {
+  int width = screen->width, height = screen->height;
+  int rows = bottom - top + 1, up = count > 0 ? count : -count;
+  bool whole = top == 0 && bottom == height - 1;
+  Cell *first = screen->shown + top * width;
+
+  client_pen(screen, out, blank);
+  if (!whole) { // the scroll region homes the cursor
+    out_printf(out, "\033[%d;%dr", top + 1, bottom + 1);
+    screen->shown_x = screen->shown_y = 0;
+  }
+  client_move(screen, out, 0, count > 0 ? bottom : top);
+  for (int i = 0; i < up; i++)
+    out_write(out, count > 0 ? "\n" : "\033M");
+  if (!whole) {
+    out_printf(out, "\033[1;%dr", height);
+    screen->shown_x = screen->shown_y = 0;
+  }
+
+  if (count > 0) {
+    memmove(first, first + up * width, (rows - up) * width * sizeof(Cell));
+    fill(first + (rows - up) * width, up * width, blank);
+  } else {
+    memmove(first + up * width, first, (rows - up) * width * sizeof(Cell));
+    fill(first, up * width, blank);
+  }
+}
+
+size_t screen_render(Screen *screen, uint8_t *data, size_t room) {
+  Out out = {data, 0, room};
+  int width = screen->width, height = screen->height;
+  int total = width * height;
+
+  // the first part of a frame needs room for a reverse index per row
+  if (room < 2 * SCREEN_MAX + 2 * CELL_WORST)
+    return 0;
+
+  if (!screen->synced) {
+    out_printf(&out, "\033[0m\033(B\017\033[1;%dr\033[?7l\033[H\033[2J",
+               height);
+    fill(screen->shown, total, blank);
+    screen->shown_pen = blank;
+    screen->shown_x = screen->shown_y = 0;
+    screen->shown_modes = screen->modes ^ CLIENT_MODES;
+    screen->scrolled = 0;
+    screen->synced = true;
+  }
+  client_modes(screen, &out);
+
+  int scrolled = screen->scrolled;
+  screen->scrolled = 0;
+  if (scrolled != 0 && abs(scrolled) <=
+                           screen->scroll_bottom - screen->scroll_top)
+    client_scroll(screen, &out, screen->scroll_top, screen->scroll_bottom,
+                  scrolled);
+
+  if (all_blank(screen->cells, total) && !all_blank(screen->shown, total)) {
+    client_pen(screen, &out, blank);
+    out_write(&out, "\033[2J");
+    fill(screen->shown, total, blank);
+  }
+
+  for (int y = 0; y < height; y++)
+    if (!render_row(screen, &out, y))
+      return out.len;
+
+  if (screen->bell)
+    out_write(&out, "\a");
+  screen->bell = false;
+  if (screen->modes & MODE_CURSOR)
+    client_move(screen, &out, screen->x, screen->y);
+  screen->changed = false;
+  return out.len;
+}
+
+size_t screen_release(Screen *screen, uint8_t *data) {
+  Out out = {data, 0, SCREEN_RELEASE};
+
+  // the scroll region homes the cursor
+  out_printf(&out, "\033[%d;%dr", screen->top + 1, screen->bottom + 1);
+  screen->shown_x = screen->shown_y = 0;
+  if (screen->modes & MODE_WRAP)
+    out_write(&out, "\033[?7h");
+  if (screen->modes & MODE_INSERT)
+    out_write(&out, "\033[4h");
+  out_printf(&out, "\033(%c\033)%c%c", screen->graphics[0] ? '0' : 'B',
+             screen->graphics[1] ? '0' : 'B', screen->charset ? 0x0e : 0x0f);
+  screen->shown_pen.attr &= ~ATTR_GRAPHICS;
+  client_pen(screen, &out, screen->pen);
+  client_move(screen, &out, screen->x, screen->y);
+  client_modes(screen, &out);
+  return out.len;
+}
+
+Screen *screen_new(int width, int height) {
+  Screen *screen = calloc(1, sizeof(Screen));
+
+  if (screen == NULL)
+    return NULL;
+  screen->modes = MODE_WRAP | MODE_CURSOR;
+  screen->pen = screen->saved_pen = blank;
+  if (!screen_resize(screen, width, height)) {
+    free(screen);
+    return NULL;
+  }
+  return screen;
+}
+
+void screen_free(Screen *screen) {
+  if (screen == NULL)
+    return;
+  free(screen->main);
+  free(screen->alt);
+  free(screen->shown);
+  free(screen);
+}
+
+// The rows that fit are kept, the bottom ones when it got shorter so the
+// cursor stays on its line
+bool screen_resize(Screen *screen, int width, int height) {
+  width = clamp(width, 1, SCREEN_MAX);
+  height = clamp(height, 1, SCREEN_MAX);
+  size_t size = (size_t)width * height * sizeof(Cell);
+  Cell *main = malloc(size), *alt = malloc(size), *shown = malloc(size);
+
+  if (main == NULL || alt == NULL || shown == NULL) {
+    free(main);
+    free(alt);
+    free(shown);
+    return false;
+  }
+  fill(main, width * height, blank);
+  fill(alt, width * height, blank);
+
+  int skip = screen->y >= height ? screen->y - height + 1 : 0;
+  int columns = width < screen->width ? width : screen->width;
+  for (int y = 0; y + skip < screen->height && y < height; y++) {
+    size_t from = (size_t)(y + skip) * screen->width;
+    memcpy(main + y * width, screen->main + from, columns * sizeof(Cell));
+    memcpy(alt + y * width, screen->alt + from, columns * sizeof(Cell));
+  }
+  free(screen->main);
+  free(screen->alt);
+  free(screen->shown);
+
+  screen->main = main;
+  screen->alt = alt;
+  screen->shown = shown;
+  screen->cells = screen->modes & MODE_ALT ? alt : main;
+  screen->width = width;
+  screen->height = height;
+  move_to(screen, screen->x, screen->y - skip);
+  screen->saved_x = clamp(screen->saved_x, 0, width - 1);
+  screen->saved_y = clamp(screen->saved_y - skip, 0, height - 1);
+  screen->top = 0;
+  screen->bottom = height - 1;
+  screen->synced = false;
+  screen->changed = true;
+  return true;
+}
@@ -0,0 +1,103 @@
+/*  screen.h
+ *   Screen state compression for telnet_server (TELNET_SCREEN).
+ *
+ *   The shell's output runs through a VT100/ANSI terminal model instead of
+ *   going to the client as it comes. The client is sent the difference
+ *   between the model's screen and the last one it was sent: the cells that
+ *   changed with the cursor moves and attribute changes they need, an erase
+ *   to the end of the line for blanked tails, and what scrolled is scrolled
+ *   on the client too, the way the program did it. Changes made while the
+ *   client is still taking the last frame are folded into the next one, so
+ *   a slow link gets the latest screen instead of every step towards it.
+ *
+ *   A cell holds one byte, as the DOS clients show them (no UTF-8).
+ */
+#ifndef SCREEN_H
+#define SCREEN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCREEN_MAX 512     // columns or rows
+#define SCREEN_PARAMS 16   // CSI parameters kept
+#define SCREEN_RELEASE 128 // bytes screen_release() writes at most
+
+typedef struct {
+  uint8_t ch;
+  uint8_t attr;
+  uint8_t fg;
+  uint8_t bg;
+} Cell;
+
+typedef struct {
+  int width;
+  int height;
+  Cell *cells; // main or alt, whichever is on
+  Cell *main;
+  Cell *alt;
+
+  // the terminal
+  int x;
+  int y;
+  bool wrap; // the last column was written, the next character wraps
+  Cell pen;
+  int top; // scroll region
+  int bottom;
+  int saved_x;
+  int saved_y;
+  Cell saved_pen;
+  bool graphics[2]; // G0 and G1 are DEC line drawing
+  int charset;      // G0 or G1 in use
+  uint8_t modes;
+
+  // the escape sequence parser
+  uint8_t state;
+  uint8_t private;
+  uint8_t intermediate;
+  int params[SCREEN_PARAMS];
+  int param_count;
+
+  // the client's screen
+  Cell *shown;
+  int shown_x; // -1 when not known
+  int shown_y;
+  Cell shown_pen;
+  uint8_t shown_modes;
+  bool synced; // shown was cleared on the client too
+  // lines the first region scrolled since the last frame scrolled, up
+  // when positive
+  int scrolled;
+  int scroll_top;
+  int scroll_bottom;
+  bool bell;
+  bool changed;
+
+  // answers to the shell's queries (cursor position, ...) for the PTY
+  uint8_t answer[32];
+  size_t answer_len;
+} Screen;
+
+// NULL when out of memory
+Screen *screen_new(int width, int height);
+void screen_free(Screen *screen);
+
+// Sizes are clamped to 1..SCREEN_MAX, false when out of memory. The client
+// gets a full frame next.
+bool screen_resize(Screen *screen, int width, int height);
+
+// Runs the shell's output through the terminal
+void screen_write(Screen *screen, const uint8_t *data, size_t len);
+
+// Whether the client's screen is behind the terminal's
+bool screen_changed(Screen *screen);
+
+// The next frame, at most room bytes. A frame that doesn't fit goes out in
+// parts, screen_changed() stays true until the last one.
+size_t screen_render(Screen *screen, uint8_t *out, size_t room);
+
+// Gives the client the terminal's modes, attributes and cursor, so the raw
+// output can go on from there. Writes at most SCREEN_RELEASE bytes.
+size_t screen_release(Screen *screen, uint8_t *out);
+
+#endif
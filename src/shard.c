@@ -0,0 +1,74 @@
+/*  shard.c
+ *   Shard configuration and CPU pinning, see shard.h.
+ */
+#define _GNU_SOURCE
+#include "shard.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define SHARD_MAX 256
+
+// CPUs the process may run on, saved before any thread gets pinned
+static cpu_set_t allowed_cpus;
+static pthread_once_t allowed_once = PTHREAD_ONCE_INIT;
+
+static void save_allowed_cpus() {
+  if (sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus) == -1) {
+    CPU_ZERO(&allowed_cpus);
+    for (long cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN); cpu++)
+      CPU_SET(cpu, &allowed_cpus);
+  }
+}
+
+int shard_count(const char *name) {
+  const char *value = getenv(name);
+  int count = value != NULL ? atoi(value) : 1;
+
+  pthread_once(&allowed_once, save_allowed_cpus);
+  if (value != NULL && count == 0)
+    count = CPU_COUNT(&allowed_cpus);
+  if (count < 1)
+    count = 1;
+  return count < SHARD_MAX ? count : SHARD_MAX;
+}
+
+int shard_backlog(const char *name) {
+  const char *value = getenv(name);
+  int backlog = value != NULL ? atoi(value) : SOMAXCONN;
+
+  return backlog > 0 ? backlog : SOMAXCONN;
+}
+
+void shard_pin(int shard) {
+  int count, cpu;
+  cpu_set_t set;
+
+  pthread_once(&allowed_once, save_allowed_cpus);
+  count = CPU_COUNT(&allowed_cpus);
+  if (count == 0)
+    return;
+
+  // the (shard % count)'th allowed CPU
+  shard %= count;
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (CPU_ISSET(cpu, &allowed_cpus) && shard-- == 0)
+      break;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    log_error("Unable to pin shard to CPU %d", cpu);
+}
+
+// sched_setaffinity(), not pthread_setaffinity_np(), so a child forked
+// from a pinned thread can call it before exec
+void shard_unpin() {
+  pthread_once(&allowed_once, save_allowed_cpus);
+  sched_setaffinity(0, sizeof(allowed_cpus), &allowed_cpus);
+}
@@ -0,0 +1,31 @@
+/*  shard.h
+ *   Listener sharding shared by ftp_server and telnet_server.
+ *
+ *   With more than one shard every shard thread binds its own listening
+ *   socket to the port with SO_REUSEPORT and runs its own accept loop, the
+ *   kernel spreads incoming connections over the listeners so a burst of
+ *   connections is neither serialized on one accept queue nor dropped when
+ *   that queue overflows. Shard threads are pinned to a CPU each.
+ *
+ *   <PREFIX>_SHARDS sets the number of shards (0 for one per CPU, 1 by
+ *   default) and <PREFIX>_BACKLOG the listen backlog of each listener
+ *   (SOMAXCONN by default, the kernel caps it at net.core.somaxconn).
+ */
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdbool.h>
+
+// Shards asked for in the environment variable name
+int shard_count(const char *name);
+
+// Listen backlog from the environment variable name
+int shard_backlog(const char *name);
+
+// Pins the calling thread to the shard'th CPU it is allowed to run on
+void shard_pin(int shard);
+
+// Lets the calling thread (or a child it forks) run on any CPU again
+void shard_unpin();
+
+#endif
@@ -0,0 +1,315 @@
+/*  telnet.c
+ *   Telnet protocol engine, see telnet.h.
+ *
+ *   Every byte is looked up in a class table (IAC, CR, the command verbs,
+ *   ...) and the class and the parser state pick a transition: the next
+ *   state and what to do with the byte. There are two class tables, BINARY
+ *   mode has no CR class, so the mode costs nothing per byte.
+ *
+ *   Options follow RFC 1143 far enough not to loop: a request that changes
+ *   nothing gets no answer, and the answer to one of our own offers isn't
+ *   answered again.
+ */
+#define _GNU_SOURCE
+#include "telnet.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TELNET_X86
+#endif
+
+// commands
+#define SE 240
+#define IP 244
+#define SB 250
+#define WILL 251
+#define WONT 252
+#define DO 253
+#define DONT 254
+#define IAC 255
+
+// options
+#define OPT_BINARY 0
+#define OPT_ECHO 1
+#define OPT_SGA 3
+#define OPT_NAWS 31
+
+// option flags, LOCAL is the server's side (WILL/WONT), REMOTE the client's
+#define LOCAL 1
+#define REMOTE 2
+#define LOCAL_ASKED 4
+#define REMOTE_ASKED 8
+
+#define CTRL_C 3 // what IAC IP turns into
+
+enum { S_DATA, S_CR, S_IAC, S_OPTION, S_SB, S_SB_IAC, STATES };
+enum { C_OTHER, C_IAC, C_CR, C_LF, C_NUL, C_SB, C_SE, C_VERB, CLASSES };
+enum { A_EMIT, A_DROP, A_VERB, A_OPTION, A_COMMAND, A_SB, A_SB_BYTE, A_SE };
+
+typedef struct {
+  uint8_t state;
+  uint8_t action;
+} Transition;
+
+#define COMMAND_CLASSES                                                        \
+  [IAC] = C_IAC, [SB] = C_SB, [SE] = C_SE, [WILL] = C_VERB, [WONT] = C_VERB,   \
+  [DO] = C_VERB, [DONT] = C_VERB
+
+static const uint8_t nvt_classes[256] = {
+    COMMAND_CLASSES, ['\r'] = C_CR, ['\n'] = C_LF, [0] = C_NUL};
+static const uint8_t binary_classes[256] = {COMMAND_CLASSES};
+
+static const Transition transitions[STATES][CLASSES] = {
+    [S_DATA] = {{S_DATA, A_EMIT}, // the data runs are moved before
+                {S_IAC, A_DROP},
+                {S_CR, A_EMIT},
+                {S_DATA, A_EMIT},
+                {S_DATA, A_EMIT},
+                {S_DATA, A_EMIT},
+                {S_DATA, A_EMIT},
+                {S_DATA, A_EMIT}},
+    // CR LF and CR NUL are one CR
+    [S_CR] = {{S_DATA, A_EMIT},
+              {S_IAC, A_DROP},
+              {S_CR, A_EMIT},
+              {S_DATA, A_DROP},
+              {S_DATA, A_DROP},
+              {S_DATA, A_EMIT},
+              {S_DATA, A_EMIT},
+              {S_DATA, A_EMIT}},
+    // IAC IAC is a 0xFF data byte
+    [S_IAC] = {{S_DATA, A_COMMAND},
+               {S_DATA, A_EMIT},
+               {S_DATA, A_COMMAND},
+               {S_DATA, A_COMMAND},
+               {S_DATA, A_COMMAND},
+               {S_SB, A_SB},
+               {S_DATA, A_COMMAND},
+               {S_OPTION, A_VERB}},
+    [S_OPTION] = {{S_DATA, A_OPTION},
+                  {S_DATA, A_OPTION},
+                  {S_DATA, A_OPTION},
+                  {S_DATA, A_OPTION},
+                  {S_DATA, A_OPTION},
+                  {S_DATA, A_OPTION},
+                  {S_DATA, A_OPTION},
+                  {S_DATA, A_OPTION}},
+    [S_SB] = {{S_SB, A_SB_BYTE},
+              {S_SB_IAC, A_DROP},
+              {S_SB, A_SB_BYTE},
+              {S_SB, A_SB_BYTE},
+              {S_SB, A_SB_BYTE},
+              {S_SB, A_SB_BYTE},
+              {S_SB, A_SB_BYTE},
+              {S_SB, A_SB_BYTE}},
+    // only IAC IAC and IAC SE are valid in a subnegotiation
+    [S_SB_IAC] = {{S_SB, A_DROP},
+                  {S_SB, A_SB_BYTE},
+                  {S_SB, A_DROP},
+                  {S_SB, A_DROP},
+                  {S_SB, A_DROP},
+                  {S_SB, A_DROP},
+                  {S_DATA, A_SE},
+                  {S_SB, A_DROP}},
+};
+
+// what each side may enable
+static const uint8_t supported[TELNET_OPTIONS] = {
+    [OPT_BINARY] = LOCAL | REMOTE,
+    [OPT_ECHO] = LOCAL,
+    [OPT_SGA] = LOCAL | REMOTE,
+    [OPT_NAWS] = REMOTE,
+};
+
+static size_t count_scalar(const uint8_t *data, size_t len);
+
+static size_t (*count_kernel)(const uint8_t *, size_t) = count_scalar;
+
+static const uint8_t *classes_of(Telnet *telnet) {
+  return telnet->options[OPT_BINARY] & REMOTE ? binary_classes : nvt_classes;
+}
+
+static void reply(Telnet *telnet, uint8_t verb, uint8_t option) {
+  if (telnet->reply_len + 3 > TELNET_REPLY_MAX) // a client flooding us
+    return;
+  telnet->reply[telnet->reply_len++] = IAC;
+  telnet->reply[telnet->reply_len++] = verb;
+  telnet->reply[telnet->reply_len++] = option;
+}
+
+static void offer(Telnet *telnet, uint8_t verb, uint8_t option) {
+  telnet->options[option] |= verb == WILL ? LOCAL_ASKED : REMOTE_ASKED;
+  reply(telnet, verb, option);
+}
+
+static void negotiate(Telnet *telnet, uint8_t verb, uint8_t option) {
+  bool local = verb == DO || verb == DONT;
+  bool enable = verb == WILL || verb == DO;
+  uint8_t side = local ? LOCAL : REMOTE;
+  uint8_t asked = local ? LOCAL_ASKED : REMOTE_ASKED;
+
+  if (option >= TELNET_OPTIONS || !(supported[option] & side)) {
+    if (enable)
+      reply(telnet, local ? WONT : DONT, option);
+    return;
+  }
+
+  uint8_t *flags = &telnet->options[option];
+  bool answer = !(*flags & asked);
+  *flags &= ~asked;
+  if (enable == ((*flags & side) != 0))
+    return;
+  *flags ^= side;
+  if (answer)
+    reply(telnet, local ? (enable ? WILL : WONT) : (enable ? DO : DONT),
+          option);
+}
+
+static void subnegotiation(Telnet *telnet) {
+  const uint8_t *sb = telnet->sb;
+
+  if (telnet->sb_len >= 5 && sb[0] == OPT_NAWS) {
+    telnet->width = sb[1] << 8 | sb[2];
+    telnet->height = sb[3] << 8 | sb[4];
+    telnet->resized = true;
+  }
+}
+
+void telnet_open(Telnet *telnet) {
+  memset(telnet, 0, sizeof(Telnet));
+  offer(telnet, WILL, OPT_ECHO);
+  offer(telnet, WILL, OPT_SGA);
+  offer(telnet, DO, OPT_NAWS);
+}
+
+size_t telnet_decode(Telnet *telnet, uint8_t *data, size_t len) {
+  const uint8_t *classes = classes_of(telnet);
+  uint8_t *in = data, *out = data, *end = data + len;
+
+  while (in < end) {
+    if (telnet->state == S_DATA) {
+      uint8_t *stop = memchr(in, IAC, end - in);
+      if (stop == NULL)
+        stop = end;
+      uint8_t *cr;
+      if (classes == nvt_classes && (cr = memchr(in, '\r', stop - in)) != NULL)
+        stop = cr;
+      if (out != in)
+        memmove(out, in, stop - in);
+      out += stop - in;
+      in = stop;
+      if (in == end)
+        break;
+    }
+
+    uint8_t byte = *in++;
+    Transition next = transitions[telnet->state][classes[byte]];
+    telnet->state = next.state;
+    switch (next.action) {
+    case A_EMIT:
+      *out++ = byte;
+      break;
+    case A_VERB:
+      telnet->verb = byte;
+      break;
+    case A_OPTION:
+      negotiate(telnet, telnet->verb, byte);
+      classes = classes_of(telnet);
+      break;
+    case A_COMMAND:
+      if (byte == IP)
+        *out++ = CTRL_C;
+      break;
+    case A_SB:
+      telnet->sb_len = 0;
+      break;
+    case A_SB_BYTE:
+      if (telnet->sb_len < TELNET_SB_MAX)
+        telnet->sb[telnet->sb_len++] = byte;
+      break;
+    case A_SE:
+      subnegotiation(telnet);
+      break;
+    }
+  }
+  return out - data;
+}
+
+bool telnet_binary(Telnet *telnet) {
+  return telnet->options[OPT_BINARY] & LOCAL;
+}
+
+// The runs between the IACs are moved up from the last one back, so every
+// byte is moved once
+size_t telnet_escape(uint8_t *data, size_t len) {
+  size_t count = count_kernel(data, len);
+  if (count == 0)
+    return len;
+
+  uint8_t *in = data + len, *out = in + count;
+  while (out > in) {
+    uint8_t *iac = memrchr(data, IAC, in - data);
+    size_t run = in - iac - 1;
+    out -= run;
+    memmove(out, iac + 1, run);
+    *--out = IAC;
+    *--out = IAC;
+    in = iac;
+  }
+  return len + count;
+}
+
+static size_t count_scalar(const uint8_t *data, size_t len) {
+  const uint8_t *end = data + len;
+  size_t count = 0;
+
+  while ((data = memchr(data, IAC, end - data)) != NULL) {
+    count++;
+    data++;
+  }
+  return count;
+}
+
+#ifdef TELNET_X86
+__attribute__((target("sse2"))) static size_t count_sse2(const uint8_t *data,
+                                                         size_t len) {
+  const __m128i iac = _mm_set1_epi8((char)IAC);
+  size_t count = 0, i;
+
+  for (i = 0; i + 16 <= len; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+    count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(block, iac)));
+  }
+  return count + count_scalar(data + i, len - i);
+}
+
+__attribute__((target("avx2"))) static size_t count_avx2(const uint8_t *data,
+                                                         size_t len) {
+  const __m256i iac = _mm256_set1_epi8((char)IAC);
+  size_t count = 0, i;
+
+  for (i = 0; i + 32 <= len; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *)(data + i));
+    count += __builtin_popcount(
+        (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, iac)));
+  }
+  return count + count_scalar(data + i, len - i);
+}
+#endif
+
+const char *telnet_init() {
+#ifdef TELNET_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    count_kernel = count_avx2;
+    return "avx2";
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    count_kernel = count_sse2;
+    return "sse2";
+  }
+#endif
+  return "scalar";
+}
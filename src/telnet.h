@@ -0,0 +1,59 @@
+/*  telnet.h
+ *   Telnet protocol engine for telnet_server (RFC 854, 855, 856, 1073).
+ *
+ *   The client's bytes go through telnet_decode(), a streaming state machine
+ *   driven by a transition table, which strips the IAC commands out, answers
+ *   option negotiation and collects the window size the client reports with
+ *   NAWS. Data runs between commands are found with memchr() and moved whole.
+ *   The shell's output only needs its 0xFF bytes doubled, telnet_escape()
+ *   counts them with SSE2 or AVX2 and leaves a buffer without any untouched,
+ *   so binary transfers (sz/rb) cost one vector scan per read.
+ *
+ *   The server offers to echo and suppress go-ahead and asks for NAWS. BINARY
+ *   is accepted both ways when the client asks for it: without it a CR from
+ *   the client is followed by LF or NUL, which is dropped so the PTY sees
+ *   one line end.
+ */
+#ifndef TELNET_H
+#define TELNET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TELNET_OPTIONS 40 // options tracked, the rest are refused
+#define TELNET_SB_MAX 64  // subnegotiation bytes kept, the rest are dropped
+#define TELNET_REPLY_MAX 256
+
+typedef struct {
+  uint8_t state;
+  uint8_t verb; // WILL, WONT, DO or DONT waiting for its option
+  uint8_t options[TELNET_OPTIONS];
+  uint8_t sb[TELNET_SB_MAX];
+  size_t sb_len;
+  // the window size from NAWS, resized until the caller applied it
+  unsigned short width;
+  unsigned short height;
+  bool resized;
+  // negotiation to send to the client, the caller takes it out
+  uint8_t reply[TELNET_REPLY_MAX];
+  size_t reply_len;
+} Telnet;
+
+// Picks the escape scan for this CPU, returns its name for the log
+const char *telnet_init();
+
+// Starts a session, the server's offers are left in reply
+void telnet_open(Telnet *telnet);
+
+// Client -> shell, in place. Returns the data bytes left in data.
+size_t telnet_decode(Telnet *telnet, uint8_t *data, size_t len);
+
+// Whether the client asked for BINARY output (file transfers)
+bool telnet_binary(Telnet *telnet);
+
+// Shell -> client, doubles every IAC in place, data needs room for 2 * len
+// bytes. Returns the bytes to send.
+size_t telnet_escape(uint8_t *data, size_t len);
+
+#endif
@@ -1,51 +1,189 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
-#include <pty.h>
 #include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <unistd.h>
 #include <utmp.h>
 
-#define BUFFER_SIZE 1024
-#define MAX_CLIENTS 10
-
-int server_fd;
-
-// Function to handle each client
-void *handle_client(void *client_socket) {
-  int client_fd = *((int *)client_socket);
-  free(client_socket);
-
-  char buffer[BUFFER_SIZE];
+#include "log.h"
+#include "ratelimit.h"
+#include "screen.h"
+#include "shard.h"
+#include "telnet.h"
+#include "timer.h"
+
+#define BUFFER_SIZE 8192 // per direction of a session
+#define MAX_EVENTS 64
+#define IDLE_TIMEOUT 1800 // seconds
+#define POOL_SIZE 4
+#define POOL_MAX 256
+#define WARMUP_TIMEOUT 5000 // ms for a new shell to print its prompt
+#define FLUSH_DELAY 5         // ms the shell's output waits for more
+#define FLUSH_SIZE 4096       // bytes that go out without waiting
+#define SCREEN_WIDTH 80       // until the client sends its size
+#define SCREEN_HEIGHT 24
+#define SCREEN_READS 16 // of the shell's output before the next session
+
+// One end of a session, the client socket or the PTY master. Both are
+// edge triggered: readable and writable stay set until a read or write
+// says EAGAIN.
+typedef struct Endpoint {
+  int fd;
+  bool readable;
+  bool writable;
+  struct Session *session;
+} Endpoint;
+
+// Bytes read from one end and not written to the other yet, decoded or
+// escaped already
+typedef struct {
+  uint8_t data[BUFFER_SIZE];
+  size_t start;
+  size_t end;
+} Buffer;
+
+typedef struct Session {
+  Endpoint client;
+  Endpoint pty;
+  Buffer to_shell;
+  Buffer to_client;
+  Telnet telnet;
+  Screen *screen; // TELNET_SCREEN, NULL when off
+  char client_ip[INET_ADDRSTRLEN];
+  long long last_active; // timer_now() of the last byte either way
+  Timer timer;
+  RateLimit rate; // TELNET_RATE, TELNET_IP_RATE and TELNET_SESSION_RATE
+  long long resume_at; // timer_now() the rate cap pauses it until, or 0
+  long long flush_at;  // timer_now() the output to the client waits until
+  bool typed;          // the client sent something since the last write
+  bool held;           // in the held list of the shard
+  bool closed;
+  struct Session *next_paused;
+  struct Session *next_held;
+  struct Session *next_closed;
+} Session;
+
+// Every shard runs an event loop over its listener and the sessions it
+// accepted, TELNET_SHARDS and TELNET_BACKLOG (see shard.h)
+typedef struct Shard {
+  int id;
+  int server_fd;
+  int epoll_fd;
+  Session *paused; // by the rate cap
+  Session *held;   // output waiting for more, see session_hold()
+  Session *closed; // freed once the events in hand are handled
+} Shard;
+
+// Shells started ahead of the clients, TELNET_POOL of them. A client gets
+// one that has printed its prompt already, the pool thread starts the
+// next ones in the background.
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wanted;
+  int size;
+  int count;
+  int shells[POOL_MAX]; // PTY masters
+} ShellPool;
+
+Shard *shards;
+int shard_total = 1;
+// TELNET_IDLE_TIMEOUT, 0 for none
+int idle_timeout = IDLE_TIMEOUT;
+// TELNET_FLUSH_DELAY (0 writes the output as it comes) and TELNET_FLUSH_SIZE
+int flush_delay = FLUSH_DELAY;
+int flush_size = FLUSH_SIZE;
+// TELNET_SCREEN, the clients get screen updates instead of the raw output
+bool screen_mode = false;
+ShellPool pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+int create_server_socket(int port, bool reuse_port, int backlog);
+void *shard_thread(void *arg);
+void event_loop(Shard *shard);
+void accept_clients(Shard *shard);
+int spawn_shell();
+int shell_take();
+void *pool_thread(void *arg);
+void pool_warm_up(int *shells, int count);
+void session_open(Shard *shard, int client_fd,
+                  struct sockaddr_in *client_addr);
+void session_pump(Shard *shard, Session *session);
+bool relay(Shard *shard, Session *session, Endpoint *from, Endpoint *to,
+           Buffer *buffer);
+bool relay_screen(Shard *shard, Session *session);
+void session_reply(Session *session);
+void session_resize(Session *session);
+void session_pause(Shard *shard, Session *session, long long wait);
+int paused_timeout(Shard *shard);
+void resume_paused(Shard *shard);
+bool session_hold(Shard *shard, Session *session);
+void session_defer(Shard *shard, Session *session, long long at);
+int held_timeout(Shard *shard);
+void flush_held(Shard *shard);
+void session_close(Shard *shard, Session *session);
+
+// Shuts the client socket down once nothing went either way for
+// idle_timeout, the event loop then sees the end of the connection
+long session_idle_expired(Timer *timer) {
+  Session *session = timer->data;
+  long limit = idle_timeout * 1000L;
+  long idle =
+      timer_now() - __atomic_load_n(&session->last_active, __ATOMIC_RELAXED);
+
+  if (idle < limit)
+    return limit - idle;
+  log_info("Client %s idle for %ds, disconnecting", session->client_ip,
+           idle_timeout);
+  shutdown(session->client.fd, SHUT_RDWR);
+  return 0;
+}
 
-  ssize_t num_bytes_read;
-  int master_fd, slave_fd;
-  pid_t pid;
+// Starts the shell on a new PTY and returns the master side, non-blocking,
+// or -1 on error. Every descriptor of the server is close-on-exec, from
+// the start, so shells forked by other shards don't inherit this one.
+int spawn_shell() {
+  char slave_name[64];
+  int master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC | O_NONBLOCK);
+  if (master_fd == -1) {
+    log_perror("posix_openpt");
+    return -1;
+  }
 
-  // Create a pseudo-terminal
-  if (openpty(&master_fd, &slave_fd, NULL, NULL, NULL) == -1) {
-    perror("openpty");
-    close(client_fd);
-    pthread_exit(NULL);
+  int slave_fd = -1;
+  if (grantpt(master_fd) == -1 || unlockpt(master_fd) == -1 ||
+      ptsname_r(master_fd, slave_name, sizeof(slave_name)) != 0 ||
+      (slave_fd = open(slave_name, O_RDWR | O_NOCTTY | O_CLOEXEC)) == -1) {
+    log_perror("openpty");
+    close(master_fd);
+    return -1;
   }
 
-  // Fork a child process
-  pid = fork();
+  pid_t pid = fork();
   if (pid == -1) {
-    perror("fork");
-    close(client_fd);
+    log_perror("fork");
     close(master_fd);
     close(slave_fd);
-    pthread_exit(NULL);
+    return -1;
   }
 
   if (pid == 0) { // Child process
-    // Close the master side of the PTY
-    close(master_fd);
+    // the server ignores SIGPIPE, the shell and what it runs must not
+    signal(SIGPIPE, SIG_DFL);
+    // nor run on the CPU of the shard that forked it
+    shard_unpin();
 
     // Redirect stdin, stdout, and stderr to the slave side of the PTY
     login_tty(slave_fd);
@@ -53,87 +191,491 @@ void *handle_client(void *client_socket) {
     // execute the shell
     execlp("/bin/sh", "-c", "./shell.sh", NULL);
     perror("execle");
-    exit(EXIT_FAILURE);
-  } else {
-    // Parent process
-    // Close the slave side of the PTY
-    close(slave_fd);
+    _exit(EXIT_FAILURE);
+  }
+
+  // Close the slave side of the PTY, the shell holds it now
+  close(slave_fd);
+  return master_fd;
+}
 
-    // relay data between the client and the shell
-    fd_set fds;
-    while (1) {
-      FD_ZERO(&fds);
-      FD_SET(client_fd, &fds);
-      FD_SET(master_fd, &fds);
-      int max_fd = (client_fd > master_fd) ? client_fd : master_fd;
-
-      if (select(max_fd + 1, &fds, NULL, NULL, NULL) == -1) {
-        perror("select");
-        break;
+// A shell from the pool, or a new one when the pool ran dry. Shells that
+// died waiting in the pool are thrown away.
+int shell_take() {
+  int master_fd = -1;
+
+  pthread_mutex_lock(&pool.lock);
+  while (master_fd == -1 && pool.count > 0) {
+    master_fd = pool.shells[--pool.count];
+    struct pollfd hangup = {.fd = master_fd};
+    if (poll(&hangup, 1, 0) == 1 && (hangup.revents & POLLHUP)) {
+      close(master_fd);
+      master_fd = -1;
+    }
+  }
+  pthread_cond_signal(&pool.wanted);
+  pthread_mutex_unlock(&pool.lock);
+
+  if (master_fd == -1) {
+    log_debug("Shell pool empty, starting a shell");
+    master_fd = spawn_shell();
+  }
+  return master_fd;
+}
+
+// Keeps the pool full. The shells missing are forked together and join
+// the pool once they printed something (their prompt), so a shell that is
+// slow to start delays nobody and a client never waits for one.
+void *pool_thread(void *arg) {
+  int shells[POOL_MAX];
+
+  while (1) {
+    pthread_mutex_lock(&pool.lock);
+    while (pool.count >= pool.size)
+      pthread_cond_wait(&pool.wanted, &pool.lock);
+    int missing = pool.size - pool.count;
+    pthread_mutex_unlock(&pool.lock);
+
+    int count = 0;
+    while (count < missing && (shells[count] = spawn_shell()) != -1)
+      count++;
+    pool_warm_up(shells, count);
+
+    pthread_mutex_lock(&pool.lock);
+    for (int i = 0; i < count; i++) {
+      if (pool.count < pool.size)
+        pool.shells[pool.count++] = shells[i];
+      else
+        close(shells[i]);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if (count < missing) // fork failed, don't spin on it
+      sleep(1);
+  }
+  return NULL;
+}
+
+// Waits until every shell has output pending or WARMUP_TIMEOUT passed
+void pool_warm_up(int *shells, int count) {
+  struct pollfd fds[POOL_MAX];
+  long long deadline = timer_now() + WARMUP_TIMEOUT;
+  int waiting = count;
+
+  for (int i = 0; i < count; i++)
+    fds[i] = (struct pollfd){.fd = shells[i], .events = POLLIN};
+  long long left;
+  while (waiting > 0 && (left = deadline - timer_now()) > 0) {
+    if (poll(fds, count, left) <= 0)
+      continue;
+    for (int i = 0; i < count; i++) {
+      if (fds[i].revents != 0) {
+        fds[i].fd = -1; // poll skips it from now on
+        waiting--;
       }
+    }
+  }
+}
+
+void session_open(Shard *shard, int client_fd,
+                  struct sockaddr_in *client_addr) {
+  Session *session = calloc(1, sizeof(Session));
+  if (session == NULL) {
+    log_perror("calloc");
+    close(client_fd);
+    return;
+  }
+
+  int master_fd = shell_take();
+  if (master_fd == -1) {
+    close(client_fd);
+    free(session);
+    return;
+  }
+
+  session->client = (Endpoint){client_fd, false, true, session};
+  session->pty = (Endpoint){master_fd, false, true, session};
+  inet_ntop(AF_INET, &client_addr->sin_addr, session->client_ip,
+            sizeof(session->client_ip));
+  log_info("Client connected from %s", session->client_ip);
+
+  // the offers go out with the first write to the client, and the prompt
+  // right after them
+  telnet_open(&session->telnet);
+  session->typed = true;
+  if (screen_mode) {
+    struct winsize size = {.ws_row = SCREEN_HEIGHT, .ws_col = SCREEN_WIDTH};
+    session->screen = screen_new(SCREEN_WIDTH, SCREEN_HEIGHT);
+    if (session->screen == NULL)
+      log_error("No memory for the screen of %s", session->client_ip);
+    else if (ioctl(master_fd, TIOCSWINSZ, &size) == -1)
+      log_perror("ioctl(TIOCSWINSZ)");
+  }
+  // the output is coalesced here, Nagle would only hold the echo back
+  int enable = 1;
+  if (flush_delay > 0 && setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY,
+                                    &enable, sizeof(enable)) == -1)
+    log_perror("setsockopt(TCP_NODELAY)");
+  session->last_active = timer_now();
+  timer_setup(&session->timer, session_idle_expired, session);
+  rate_open(&session->rate, session->client_ip);
+  if (idle_timeout > 0)
+    timer_arm(&session->timer, idle_timeout * 1000L);
+
+  // whatever is readable already is reported right away
+  struct epoll_event event = {.events =
+                                  EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET};
+  event.data.ptr = &session->client;
+  if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1) {
+    log_perror("epoll_ctl");
+    session_close(shard, session);
+    return;
+  }
+  event.data.ptr = &session->pty;
+  if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, master_fd, &event) == -1) {
+    log_perror("epoll_ctl");
+    session_close(shard, session);
+  }
+}
+
+// Relays both ways as far as the ends and the buffers allow
+void session_pump(Shard *shard, Session *session) {
+  if (session->closed)
+    return;
+  if (!relay(shard, session, &session->client, &session->pty,
+             &session->to_shell) ||
+      !(session->screen != NULL
+            ? relay_screen(shard, session)
+            : relay(shard, session, &session->pty, &session->client,
+                    &session->to_client)))
+    session_close(shard, session);
+}
+
+// Moves bytes from one end to the other until one of them would block.
+// Nothing more is read while the buffer is full, so a slow client holds
+// the shell back (and a slow shell the client) instead of having its
+// output pile up here. False once from is at its end (the PTY master
+// reads EIO when the shell is gone) or either end failed.
+bool relay(Shard *shard, Session *session, Endpoint *from, Endpoint *to,
+           Buffer *buffer) {
+  bool to_client = to == &session->client;
+
+  while (1) {
+    if (to_client)
+      session_reply(session);
+    while (buffer->start < buffer->end && to->writable &&
+           !(to_client && session_hold(shard, session))) {
+      ssize_t written = write(to->fd, buffer->data + buffer->start,
+                              buffer->end - buffer->start);
+      if (written >= 0) {
+        buffer->start += written;
+        if (to_client)
+          session->typed = false;
+      } else if (errno == EAGAIN)
+        to->writable = false;
+      else if (errno != EINTR)
+        return false;
+    }
+    if (buffer->start == buffer->end) {
+      buffer->start = buffer->end = 0;
+      if (to_client)
+        session->flush_at = 0;
+    }
+
+    // escaping can double what the shell writes
+    size_t room = BUFFER_SIZE - buffer->end;
+    if (to_client)
+      room /= 2;
+    if (!from->readable || room == 0 || session->resume_at != 0)
+      return true;
+
+    ssize_t got = read(from->fd, buffer->data + buffer->end, room);
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got < 0 && errno == EAGAIN) {
+      from->readable = false;
+      return true;
+    }
+    if (got <= 0)
+      return false;
+    __atomic_store_n(&session->last_active, timer_now(), __ATOMIC_RELAXED);
+    if (to_client) {
+      got = telnet_escape(buffer->data + buffer->end, got);
+    } else {
+      got = telnet_decode(&session->telnet, buffer->data + buffer->end, got);
+      if (session->telnet.resized)
+        session_resize(session);
+      if (got > 0)
+        session->typed = true;
+    }
+    buffer->end += got;
+
+    // keystrokes and the echo of them, the output until the next write to
+    // the client, don't wait for the cap
+    long long wait = rate_charge(&session->rate, got, session->typed);
+    if (wait > 0)
+      session_pause(shard, session, wait);
+  }
+}
 
-      // receive data from the client
-      if (FD_ISSET(client_fd, &fds)) {
-        num_bytes_read = read(client_fd, buffer, sizeof(buffer) - 1);
-        if (num_bytes_read <= 0) {
-          break;
-        }
-        buffer[num_bytes_read] = '\0';
-        write(master_fd, buffer, num_bytes_read);
+// Queues the answers to the client's negotiation, between two reads of
+// the shell's output
+void session_reply(Session *session) {
+  Telnet *telnet = &session->telnet;
+  Buffer *buffer = &session->to_client;
+
+  if (telnet->reply_len == 0 ||
+      telnet->reply_len > BUFFER_SIZE - buffer->end)
+    return;
+  memcpy(buffer->data + buffer->end, telnet->reply, telnet->reply_len);
+  buffer->end += telnet->reply_len;
+  telnet->reply_len = 0;
+  session->typed = true;
+}
+
+// Passes the window size from NAWS to the PTY, the kernel sends the shell
+// SIGWINCH. The screen model takes the size too, as far as it goes.
+void session_resize(Session *session) {
+  struct winsize size = {.ws_row = session->telnet.height,
+                         .ws_col = session->telnet.width};
+  Screen *screen = session->screen;
+
+  session->telnet.resized = false;
+  if (screen != NULL && size.ws_row > 0 && size.ws_col > 0) {
+    if (!screen_resize(screen, size.ws_col, size.ws_row))
+      log_error("No memory for the screen of %s", session->client_ip);
+    size.ws_row = screen->height;
+    size.ws_col = screen->width;
+  }
+  if (ioctl(session->pty.fd, TIOCSWINSZ, &size) == -1)
+    log_perror("ioctl(TIOCSWINSZ)");
+  else
+    log_debug("Client %s window %dx%d", session->client_ip,
+              session->telnet.width, session->telnet.height);
+}
+
+// The shell's output goes through the screen model and the client gets a
+// frame of what changed each time it took the last one. The shell never
+// waits for the client: a client that can't keep up (or is held back by
+// the rate cap) misses the frames in between. Once the client asks for
+// BINARY, for a file transfer, it gets the raw output from then on.
+bool relay_screen(Shard *shard, Session *session) {
+  Screen *screen = session->screen;
+  Buffer *buffer = &session->to_client;
+  Endpoint *pty = &session->pty, *client = &session->client;
+  uint8_t chunk[BUFFER_SIZE];
+  int reads = 0;
+
+  while (1) {
+    session_reply(session);
+    while (buffer->start < buffer->end && client->writable) {
+      ssize_t written = write(client->fd, buffer->data + buffer->start,
+                              buffer->end - buffer->start);
+      if (written >= 0) {
+        buffer->start += written;
+        session->typed = false;
+      } else if (errno == EAGAIN)
+        client->writable = false;
+      else if (errno != EINTR)
+        return false;
+    }
+
+    if (buffer->start == buffer->end) {
+      buffer->start = buffer->end = 0;
+      bool binary = telnet_binary(&session->telnet);
+      if (screen_changed(screen) && session->resume_at == 0 &&
+          (binary || !session_hold(shard, session))) {
+        size_t len = screen_render(screen, buffer->data, BUFFER_SIZE / 2);
+        buffer->end = telnet_escape(buffer->data, len);
+        // the rest of a frame too big for the buffer follows right away
+        if (!screen_changed(screen))
+          session->flush_at = 0;
+        long long wait =
+            rate_charge(&session->rate, buffer->end, session->typed);
+        if (wait > 0)
+          session_pause(shard, session, wait);
+        continue;
       }
-      // send data to the client
-      if (FD_ISSET(master_fd, &fds)) {
-        num_bytes_read = read(master_fd, buffer, sizeof(buffer));
-        if (num_bytes_read <= 0) {
-          break;
-        }
-        write(client_fd, buffer, num_bytes_read);
+      if (binary && !screen_changed(screen)) {
+        buffer->end = screen_release(screen, buffer->data);
+        screen_free(screen);
+        session->screen = NULL;
+        log_debug("Client %s switched to binary, raw output",
+                  session->client_ip);
+        return relay(shard, session, pty, client, buffer);
       }
-      fflush(stdout);
     }
 
-    // wait for the child process to terminate
-    waitpid(pid, NULL, 0);
+    if (!pty->readable)
+      return true;
+    // a shell that never stops writing doesn't keep the shard to itself
+    if (++reads > SCREEN_READS) {
+      session_defer(shard, session, timer_now());
+      return true;
+    }
+    ssize_t got = read(pty->fd, chunk, sizeof(chunk));
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got < 0 && errno == EAGAIN) {
+      pty->readable = false;
+      return true;
+    }
+    if (got <= 0)
+      return false;
+    __atomic_store_n(&session->last_active, timer_now(), __ATOMIC_RELAXED);
+
+    screen_write(screen, chunk, got);
+    if (screen->answer_len > 0 &&
+        write(pty->fd, screen->answer, screen->answer_len) == -1)
+      log_perror("write");
+    screen->answer_len = 0;
+  }
+}
 
-    // client ip address
-    struct sockaddr_in client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
-    getpeername(client_fd, (struct sockaddr *)&client_addr, &client_addr_len);
+// Stops reading both ends for wait nanoseconds, what is buffered still
+// goes out
+void session_pause(Shard *shard, Session *session, long long wait) {
+  session->resume_at = timer_now() + (wait + 999999) / 1000000;
+  session->next_paused = shard->paused;
+  shard->paused = session;
+}
 
-    printf("Client disconnected from %s\n", inet_ntoa(client_addr.sin_addr));
+// Milliseconds until the first paused session may go on, -1 for none
+int paused_timeout(Shard *shard) {
+  long long first = -1;
+
+  for (Session *session = shard->paused; session != NULL;
+       session = session->next_paused)
+    if (first == -1 || session->resume_at < first)
+      first = session->resume_at;
+  if (first == -1)
+    return -1;
+  long long now = timer_now();
+  return first > now ? first - now : 0;
+}
 
-    // close the client and master PTY file descriptors
-    close(client_fd);
-    close(master_fd);
+void resume_paused(Shard *shard) {
+  long long now = timer_now();
+  Session **link = &shard->paused;
+
+  while (*link != NULL) {
+    Session *session = *link;
+    if (session->resume_at > now) {
+      link = &session->next_paused;
+      continue;
+    }
+    *link = session->next_paused;
+    session->resume_at = 0;
+    session_pump(shard, session);
   }
+}
 
-  pthread_exit(NULL);
+// Whether the output to the client waits for more to join it. The shell
+// writes a screen update in many small pieces, they go out together once
+// flush_size bytes are in or flush_delay after the first one. Whatever
+// answers the client (echo, the output of a command) goes right away.
+bool session_hold(Shard *shard, Session *session) {
+  Buffer *buffer = &session->to_client;
+
+  if (flush_delay == 0 || session->typed ||
+      buffer->end - buffer->start >= flush_size)
+    return false;
+  long long now = timer_now();
+  if (session->flush_at == 0)
+    session_defer(shard, session, now + flush_delay);
+  return now < session->flush_at;
 }
 
-void handle_sigint(int sig) {
-  printf("Shutting down the server...\n");
-  close(server_fd);
-  exit(EXIT_SUCCESS);
+// Has flush_held() pump the session at the latest at at
+void session_defer(Shard *shard, Session *session, long long at) {
+  if (session->flush_at == 0 || at < session->flush_at)
+    session->flush_at = at;
+  if (!session->held) {
+    session->held = true;
+    session->next_held = shard->held;
+    shard->held = session;
+  }
 }
 
-int main(int argc, char *argv[]) {
-  int port = 12345;
+// Milliseconds until the first held output is due, -1 for none
+int held_timeout(Shard *shard) {
+  long long first = -1;
+
+  for (Session *session = shard->held; session != NULL;
+       session = session->next_held)
+    if (session->flush_at != 0 && (first == -1 || session->flush_at < first))
+      first = session->flush_at;
+  if (first == -1)
+    return -1;
+  long long now = timer_now();
+  return first > now ? first - now : 0;
+}
 
-  // parse command line arguments to get the port if any
-  if (argc == 2) {
-    port = atoi(argv[1]);
+// Writes the held output that is due, sessions that wrote theirs already
+// just leave the list
+void flush_held(Shard *shard) {
+  long long now = timer_now();
+  Session **link = &shard->held;
+
+  while (*link != NULL) {
+    Session *session = *link;
+    if (session->flush_at > now) {
+      link = &session->next_held;
+      continue;
+    }
+    *link = session->next_held;
+    session->held = false;
+    if (session->flush_at != 0)
+      session_pump(shard, session);
   }
+}
 
-  struct sockaddr_in server_addr, client_addr;
-  socklen_t client_addr_len = sizeof(client_addr);
+// Closing the master hangs the shell up (SIGHUP) and closing the
+// descriptors takes them out of the epoll set. The session is freed by
+// the event loop, events for it may still be in hand.
+void session_close(Shard *shard, Session *session) {
+  timer_cancel(&session->timer);
+  rate_close(&session->rate);
+  if (session->resume_at != 0) {
+    Session **link = &shard->paused;
+    while (*link != session)
+      link = &(*link)->next_paused;
+    *link = session->next_paused;
+  }
+  if (session->held) {
+    Session **link = &shard->held;
+    while (*link != session)
+      link = &(*link)->next_held;
+    *link = session->next_held;
+  }
 
-  signal(SIGINT, handle_sigint); // Handle SIGINT for graceful shutdown
+  screen_free(session->screen);
+  close(session->pty.fd);
+  close(session->client.fd);
+  log_info("Client disconnected from %s", session->client_ip);
 
-  // create a socket
-  server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  session->closed = true;
+  session->next_closed = shard->closed;
+  shard->closed = session;
+}
+
+void handle_sigint(int sig) {
+  log_info("Shutting down the server...");
+  for (int i = 0; i < shard_total; i++)
+    close(shards[i].server_fd);
+  exit(EXIT_SUCCESS);
+}
+
+// Listening socket on port, shards share the port with SO_REUSEPORT
+int create_server_socket(int port, bool reuse_port, int backlog) {
+  struct sockaddr_in server_addr;
+
+  // create a socket, the event loop accepts until EAGAIN
+  int server_fd =
+      socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
   if (server_fd == -1) {
-    perror("socket");
-    exit(EXIT_FAILURE);
+    log_perror("socket");
+    return -1;
   }
 
   // set up the server address struct
@@ -146,61 +688,198 @@ int main(int argc, char *argv[]) {
   int enable = 1;
   if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) ==
       -1) {
-    perror("setsockopt");
+    log_perror("setsockopt");
     close(server_fd);
-    exit(EXIT_FAILURE);
+    return -1;
+  }
+
+  if (reuse_port && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &enable,
+                               sizeof(int)) == -1) {
+    log_perror("setsockopt(SO_REUSEPORT)");
+    close(server_fd);
+    return -1;
   }
 
   // bind the socket to the specified port
   if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) ==
       -1) {
-    perror("bind");
+    log_perror("bind");
     close(server_fd);
-    exit(EXIT_FAILURE);
+    return -1;
   }
 
   // listen for incoming connections
-  if (listen(server_fd, MAX_CLIENTS) == -1) {
-    perror("listen");
+  if (listen(server_fd, backlog) == -1) {
+    log_perror("listen");
     close(server_fd);
-    exit(EXIT_FAILURE);
+    return -1;
+  }
+
+  return server_fd;
+}
+
+void accept_clients(Shard *shard) {
+  struct sockaddr_in client_addr;
+  socklen_t client_addr_len;
+
+  while (1) {
+    client_addr_len = sizeof(client_addr);
+    int client_fd =
+        accept4(shard->server_fd, (struct sockaddr *)&client_addr,
+                &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN)
+        log_perror("accept");
+      return;
+    }
+    session_open(shard, client_fd, &client_addr);
   }
+}
 
-  printf("telnet_server running..\n");
-  printf("Server is listening on port %d\n", port);
+// One thread for every session of the shard, it only sleeps in epoll_wait
+void event_loop(Shard *shard) {
+  struct epoll_event events[MAX_EVENTS];
 
-  // accept and handle clients
   while (1) {
-    int *client_fd = malloc(sizeof(int));
-    if (client_fd == NULL) {
-      perror("malloc");
-      close(server_fd);
+    int timeout = paused_timeout(shard);
+    int held = held_timeout(shard);
+    if (timeout == -1 || (held != -1 && held < timeout))
+      timeout = held;
+    int count = epoll_wait(shard->epoll_fd, events, MAX_EVENTS, timeout);
+    if (count == -1) {
+      if (errno == EINTR)
+        continue;
+      log_perror("epoll_wait");
       exit(EXIT_FAILURE);
     }
 
-    *client_fd =
-        accept(server_fd, (struct sockaddr *)&client_addr, &client_addr_len);
-    if (*client_fd == -1) {
-      perror("accept");
-      free(client_fd);
-      continue;
+    for (int i = 0; i < count; i++) {
+      Endpoint *endpoint = events[i].data.ptr;
+      if (endpoint == NULL) { // the listener
+        accept_clients(shard);
+        continue;
+      }
+      if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        endpoint->readable = true;
+      if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+        endpoint->writable = true;
+      session_pump(shard, endpoint->session);
+    }
+    resume_paused(shard);
+    flush_held(shard);
+
+    while (shard->closed != NULL) {
+      Session *session = shard->closed;
+      shard->closed = session->next_closed;
+      free(session);
     }
+  }
+}
 
-    printf("Client connected from %s\n", inet_ntoa(client_addr.sin_addr));
+void *shard_thread(void *arg) {
+  Shard *shard = arg;
 
-    pthread_t thread;
-    if (pthread_create(&thread, NULL, handle_client, client_fd) != 0) {
-      perror("pthread_create");
-      free(client_fd);
-      continue;
+  if (shard_total > 1)
+    shard_pin(shard->id);
+  event_loop(shard);
+  return NULL;
+}
+
+int main(int argc, char *argv[]) {
+  int port = 12345;
+
+  log_init();
+
+  // parse command line arguments to get the port if any
+  if (argc == 2) {
+    port = atoi(argv[1]);
+  }
+
+  int backlog = shard_backlog("TELNET_BACKLOG");
+  shard_total = shard_count("TELNET_SHARDS");
+  shards = calloc(shard_total, sizeof(Shard));
+  if (shards == NULL) {
+    log_perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  idle_timeout = timer_limit("TELNET_IDLE_TIMEOUT", IDLE_TIMEOUT);
+  if (!timer_init())
+    exit(EXIT_FAILURE);
+  flush_delay = timer_limit("TELNET_FLUSH_DELAY", FLUSH_DELAY);
+  const char *screen = getenv("TELNET_SCREEN");
+  screen_mode = screen != NULL && atoi(screen) > 0;
+  const char *size = getenv("TELNET_FLUSH_SIZE");
+  flush_size = size != NULL ? atoi(size) : FLUSH_SIZE;
+  if (flush_size <= 0 || flush_size > BUFFER_SIZE)
+    flush_size = BUFFER_SIZE;
+  rate_init("TELNET");
+  log_info("IAC escape scan: %s", telnet_init());
+
+  const char *pool_size = getenv("TELNET_POOL");
+  pool.size = pool_size != NULL ? atoi(pool_size) : POOL_SIZE;
+  if (pool.size < 0)
+    pool.size = 0;
+  if (pool.size > POOL_MAX)
+    pool.size = POOL_MAX;
+
+  signal(SIGINT, handle_sigint); // Handle SIGINT for graceful shutdown
+  signal(SIGPIPE, SIG_IGN);       // a client gone mid write is a failed write
+  // shells that exit are reaped by the kernel, nobody waits for them
+  struct sigaction child = {.sa_handler = SIG_DFL, .sa_flags = SA_NOCLDWAIT};
+  sigaction(SIGCHLD, &child, NULL);
+
+  for (int i = 0; i < shard_total; i++) {
+    Shard *shard = &shards[i];
+    shard->id = i;
+    shard->server_fd = create_server_socket(port, shard_total > 1, backlog);
+    if (shard->server_fd == -1)
+      exit(EXIT_FAILURE);
+
+    struct epoll_event event = {.events = EPOLLIN | EPOLLET,
+                                .data.ptr = NULL};
+    shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (shard->epoll_fd == -1 ||
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->server_fd,
+                  &event) == -1) {
+      log_perror("epoll");
+      exit(EXIT_FAILURE);
     }
+  }
 
-    // detach the thread to handle client independently
+  log_info("telnet_server running..");
+  log_info("Server is listening on port %d (%d shards, backlog %d)", port,
+           shard_total, backlog);
+  log_info("Idle timeout %ds, %d shells kept ready", idle_timeout,
+           pool.size);
+  if (flush_delay > 0)
+    log_info("Output coalesced for %dms or %d bytes", flush_delay,
+             flush_size);
+  if (screen_mode)
+    log_info("Clients get screen updates instead of the raw output");
+
+  if (pool.size > 0) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, pool_thread, NULL) != 0) {
+      log_perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
     pthread_detach(thread);
   }
 
-  // close the server socket (unreachable code, server exits on SIGINT)
-  close(server_fd);
+  // shard 0 runs on the main thread
+  for (int i = 1; i < shard_total; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, shard_thread, &shards[i]) != 0) {
+      log_perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+  }
+  shard_thread(&shards[0]);
 
+  // unreachable, the server exits on SIGINT
   return 0;
 }
@@ -0,0 +1,162 @@
+/*  timer.c
+ *   Hierarchical timer wheel, see timer.h.
+ *
+ *   A timer due in delta ticks goes to the level whose span covers delta,
+ *   in the slot of its expiry tick at that level's resolution. Every 64
+ *   ticks the next slot of level 1 is emptied into level 0 (and every 64^2
+ *   the next of level 2 into level 1, ...), so a timer is moved at most
+ *   once per level before it fires.
+ */
+#define _GNU_SOURCE
+#include "timer.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "log.h"
+
+#define TIMER_LEVELS 4
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_MASK (TIMER_SLOTS - 1)
+
+typedef struct {
+  pthread_mutex_t lock;
+  unsigned long long now; // ticks processed
+  Timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+} TimerWheel;
+
+static TimerWheel wheel = {PTHREAD_MUTEX_INITIALIZER};
+
+static void wheel_add(Timer *timer) {
+  unsigned long long delta = timer->expires - wheel.now;
+  int level = 0;
+
+  while (level < TIMER_LEVELS - 1 &&
+         delta >= 1ull << (TIMER_BITS * (level + 1)))
+    level++;
+  if (delta >= 1ull << (TIMER_BITS * TIMER_LEVELS)) // beyond the wheel
+    timer->expires = wheel.now + (1ull << (TIMER_BITS * TIMER_LEVELS)) - 1;
+
+  int index = (timer->expires >> (TIMER_BITS * level)) & TIMER_MASK;
+  Timer **slot = &wheel.slots[level][index];
+  timer->next = *slot;
+  if (timer->next != NULL)
+    timer->next->pprev = &timer->next;
+  timer->pprev = slot;
+  *slot = timer;
+}
+
+static void wheel_remove(Timer *timer) {
+  *timer->pprev = timer->next;
+  if (timer->next != NULL)
+    timer->next->pprev = timer->pprev;
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+static unsigned long long ticks(long ms) {
+  return ms <= 0 ? 1 : (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+}
+
+// Moves the slot of level due at the current tick down the wheel
+static void wheel_cascade(int level) {
+  int index = (wheel.now >> (TIMER_BITS * level)) & TIMER_MASK;
+  Timer *timer = wheel.slots[level][index];
+
+  wheel.slots[level][index] = NULL;
+  while (timer != NULL) {
+    Timer *next = timer->next;
+    wheel_add(timer);
+    timer = next;
+  }
+}
+
+static void wheel_tick() {
+  wheel.now++;
+  for (int level = 1; level < TIMER_LEVELS; level++) {
+    if ((wheel.now & ((1ull << (TIMER_BITS * level)) - 1)) != 0)
+      break;
+    wheel_cascade(level);
+  }
+
+  Timer **slot = &wheel.slots[0][wheel.now & TIMER_MASK];
+  while (*slot != NULL) {
+    Timer *timer = *slot;
+    wheel_remove(timer);
+    long again = timer->callback(timer);
+    if (again > 0) {
+      timer->expires = wheel.now + ticks(again);
+      wheel_add(timer);
+    }
+  }
+}
+
+static void *timer_thread(void *arg) {
+  struct timespec next;
+
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (1) {
+    next.tv_nsec += TIMER_TICK_MS * 1000000L;
+    if (next.tv_nsec >= 1000000000L) {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000L;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) ==
+           EINTR)
+      ;
+    pthread_mutex_lock(&wheel.lock);
+    wheel_tick();
+    pthread_mutex_unlock(&wheel.lock);
+  }
+  return NULL;
+}
+
+bool timer_init() {
+  pthread_t thread;
+
+  if (pthread_create(&thread, NULL, timer_thread, NULL) != 0) {
+    log_perror("pthread_create");
+    return false;
+  }
+  pthread_detach(thread);
+  return true;
+}
+
+void timer_setup(Timer *timer, long (*callback)(Timer *timer), void *data) {
+  timer->next = NULL;
+  timer->pprev = NULL;
+  timer->callback = callback;
+  timer->data = data;
+}
+
+void timer_arm(Timer *timer, long ms) {
+  pthread_mutex_lock(&wheel.lock);
+  if (timer->pprev != NULL)
+    wheel_remove(timer);
+  timer->expires = wheel.now + ticks(ms);
+  wheel_add(timer);
+  pthread_mutex_unlock(&wheel.lock);
+}
+
+void timer_cancel(Timer *timer) {
+  pthread_mutex_lock(&wheel.lock);
+  if (timer->pprev != NULL)
+    wheel_remove(timer);
+  pthread_mutex_unlock(&wheel.lock);
+}
+
+long long timer_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+int timer_limit(const char *name, int seconds) {
+  const char *value = getenv(name);
+  int limit = value != NULL ? atoi(value) : seconds;
+
+  return limit > 0 ? limit : 0;
+}
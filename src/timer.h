@@ -0,0 +1,49 @@
+/*  timer.h
+ *   Timeouts for ftp_server and telnet_server: a hierarchical timer wheel
+ *   driven by one background thread.
+ *
+ *   Four levels of 64 slots, a tick of TIMER_TICK_MS: level 0 holds the
+ *   timers due in the next 64 ticks, each level above spans 64 times more
+ *   and is cascaded down as the wheel turns. Arming and cancelling are a
+ *   list insert and unlink, so thousands of sessions cost nothing until
+ *   their timers actually fire.
+ *
+ *   Callbacks run on the timer thread with the wheel locked: they must be
+ *   short, must not block and must not arm or cancel timers, they return
+ *   the milliseconds after which to run again (0 for done). Once
+ *   timer_cancel() returns the callback isn't running and won't run, so the
+ *   timer and what it points to can be freed.
+ */
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+
+#define TIMER_TICK_MS 250
+
+typedef struct Timer {
+  struct Timer *next;
+  struct Timer **pprev; // NULL while not armed
+  unsigned long long expires; // tick
+  long (*callback)(struct Timer *timer);
+  void *data;
+} Timer;
+
+// Starts the timer thread, false if it couldn't be created
+bool timer_init();
+
+void timer_setup(Timer *timer, long (*callback)(Timer *timer), void *data);
+
+// (Re)arms timer to fire after ms milliseconds
+void timer_arm(Timer *timer, long ms);
+
+void timer_cancel(Timer *timer);
+
+// Monotonic clock in milliseconds
+long long timer_now();
+
+// A limit in seconds from the environment variable name, or seconds when
+// it isn't set. 0 turns the timeout off.
+int timer_limit(const char *name, int seconds);
+
+#endif
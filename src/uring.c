@@ -0,0 +1,223 @@
+/*  uring.c
+ *   io_uring system call wrappers, see uring.h.
+ *
+ *   The rings are shared with the kernel, indexes it writes (sq head, cq
+ *   tail) are read with acquire loads and the ones we write (sq tail, cq
+ *   head) stored with release, which is all the ordering io_uring needs.
+ */
+#define _GNU_SOURCE
+#include "uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static int sys_setup(unsigned entries, struct io_uring_params *params) {
+  return syscall(SYS_io_uring_setup, entries, params);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned wait,
+                     unsigned flags) {
+  return syscall(SYS_io_uring_enter, fd, to_submit, wait, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned opcode, const void *arg,
+                        unsigned count) {
+  return syscall(SYS_io_uring_register, fd, opcode, arg, count);
+}
+
+bool uring_init(Uring *ring, unsigned entries, unsigned buffer_count,
+                size_t buffer_size) {
+  struct io_uring_params params;
+
+  memset(ring, 0, sizeof(Uring));
+  memset(&params, 0, sizeof(params));
+  ring->fd = sys_setup(entries, &params);
+  if (ring->fd < 0)
+    return false;
+  ring->entries = params.sq_entries;
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(int);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size)
+      ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = 0;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+    goto fail;
+  if (ring->cq_ring_size == 0) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring =
+        mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED)
+      goto fail;
+  }
+  ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto fail;
+
+  char *sq = ring->sq_ring;
+  char *cq = ring->cq_ring;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sqe_tail = *ring->sq_tail;
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  // entry i of the queue is always sqes[i]
+  unsigned *array = (unsigned *)(sq + params.sq_off.array);
+  for (unsigned i = 0; i < params.sq_entries; i++)
+    array[i] = i;
+
+  if (buffer_count > 0) {
+    struct iovec *iov = calloc(buffer_count, sizeof(struct iovec));
+    if (iov == NULL || posix_memalign((void **)&ring->buffers, 4096,
+                                      buffer_count * buffer_size) != 0) {
+      free(iov);
+      ring->buffers = NULL;
+      errno = ENOMEM;
+      goto fail;
+    }
+    for (unsigned i = 0; i < buffer_count; i++) {
+      iov[i].iov_base = ring->buffers + i * buffer_size;
+      iov[i].iov_len = buffer_size;
+    }
+    int result =
+        sys_register(ring->fd, IORING_REGISTER_BUFFERS, iov, buffer_count);
+    free(iov);
+    if (result < 0)
+      goto fail;
+    ring->buffer_count = buffer_count;
+    ring->buffer_size = buffer_size;
+  }
+  return true;
+
+fail:;
+  int saved = errno;
+  uring_free(ring);
+  errno = saved;
+  return false;
+}
+
+void uring_free(Uring *ring) {
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+  if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED &&
+      ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->fd >= 0)
+    close(ring->fd);
+  free(ring->buffers);
+  memset(ring, 0, sizeof(Uring));
+  ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_sqe(Uring *ring) {
+  while (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+         ring->entries) {
+    if (uring_submit(ring, 0) < 0 && errno != EAGAIN)
+      return NULL;
+  }
+
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+  ring->sqe_tail++;
+  __atomic_add_fetch(&ring->inflight, 1, __ATOMIC_RELAXED);
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  return sqe;
+}
+
+unsigned uring_flush(Uring *ring) {
+  unsigned published = *ring->sq_tail;
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+  return ring->sqe_tail - published;
+}
+
+int uring_enter(Uring *ring, unsigned to_submit, unsigned wait) {
+  int result;
+
+  do {
+    result = sys_enter(ring->fd, to_submit, wait,
+                       wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+  } while (result < 0 && errno == EINTR);
+  return result;
+}
+
+int uring_submit(Uring *ring, unsigned wait) {
+  return uring_enter(ring, uring_flush(ring), wait);
+}
+
+struct io_uring_cqe *uring_cqe(Uring *ring) {
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &ring->cqes[head & *ring->cq_mask];
+}
+
+// a multishot request lives on until a completion without F_MORE
+void uring_seen(Uring *ring) {
+  struct io_uring_cqe *cqe = &ring->cqes[*ring->cq_head & *ring->cq_mask];
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    __atomic_sub_fetch(&ring->inflight, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+struct io_uring_cqe *uring_wait(Uring *ring) {
+  struct io_uring_cqe *cqe;
+
+  while ((cqe = uring_cqe(ring)) == NULL) {
+    if (uring_submit(ring, 1) < 0)
+      return NULL;
+  }
+  return cqe;
+}
+
+bool uring_cancel(Uring *ring, uint64_t user_data) {
+  struct io_uring_sqe *sqe = uring_sqe(ring);
+
+  if (sqe == NULL)
+    return false;
+  uring_prep(sqe, IORING_OP_ASYNC_CANCEL, -1, NULL, 0, 0, UINT64_MAX);
+  sqe->addr = user_data;
+  return true;
+}
+
+bool uring_drain(Uring *ring) {
+  while (__atomic_load_n(&ring->inflight, __ATOMIC_RELAXED) > 0) {
+    if (uring_wait(ring) == NULL)
+      return false;
+    uring_seen(ring);
+  }
+  return true;
+}
+
+char *uring_buffer(Uring *ring, unsigned index) {
+  return ring->buffers + index * ring->buffer_size;
+}
+
+void uring_prep(struct io_uring_sqe *sqe, int op, int fd, const void *addr,
+                unsigned len, uint64_t offset, uint64_t user_data) {
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)addr;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->user_data = user_data;
+}
@@ -0,0 +1,87 @@
+/*  uring.h
+ *   A minimal io_uring on top of the raw system calls (no liburing).
+ *
+ *   Submission queue entries are filled with uring_sqe() and handed to the
+ *   kernel in batches, uring_submit() both submits and waits for completions
+ *   with a single io_uring_enter(). A ring may own an area of registered
+ *   buffers for the *_FIXED operations, the kernel then doesn't have to map
+ *   the pages on every request.
+ *
+ *   The submission side isn't thread safe, rings used by more than one
+ *   thread need a lock around uring_sqe() and uring_flush(), uring_enter()
+ *   can be called concurrently.
+ */
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+  int fd;
+  unsigned entries;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned sqe_tail; // filled, not yet published to the kernel
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  char *buffers; // registered, buffer_count of buffer_size bytes
+  unsigned buffer_count;
+  size_t buffer_size;
+  // requests without their last completion yet, atomic: a shared ring is
+  // filled under a lock but its completions are reaped without it
+  unsigned inflight;
+} Uring;
+
+// Sets up a ring of entries submission entries and, when buffer_count > 0,
+// registers that many page aligned buffers. False with errno set when the
+// kernel doesn't have io_uring or doesn't allow it.
+bool uring_init(Uring *ring, unsigned entries, unsigned buffer_count,
+                size_t buffer_size);
+void uring_free(Uring *ring);
+
+// Next free submission entry, cleared. A full queue is submitted first.
+struct io_uring_sqe *uring_sqe(Uring *ring);
+
+// Publishes the entries filled so far, returns how many
+unsigned uring_flush(Uring *ring);
+
+// io_uring_enter() for to_submit published entries, waiting until at least
+// wait completions are available. Returns the number submitted or -1.
+int uring_enter(Uring *ring, unsigned to_submit, unsigned wait);
+
+// uring_flush() and uring_enter() in one go
+int uring_submit(Uring *ring, unsigned wait);
+
+// Oldest unseen completion or NULL, uring_seen() consumes it
+struct io_uring_cqe *uring_cqe(Uring *ring);
+void uring_seen(Uring *ring);
+
+// Waits for the next completion, NULL on error
+struct io_uring_cqe *uring_wait(Uring *ring);
+
+// Asks the kernel to cancel the request with this user_data, false when the
+// queue is broken. The cancellation has a completion of its own, with
+// UINT64_MAX for user_data.
+bool uring_cancel(Uring *ring, uint64_t user_data);
+
+// Waits for every request in flight and drops their completions, so none is
+// taken for a later request's. False when the ring can't wait any more.
+bool uring_drain(Uring *ring);
+
+char *uring_buffer(Uring *ring, unsigned index);
+
+void uring_prep(struct io_uring_sqe *sqe, int op, int fd, const void *addr,
+                unsigned len, uint64_t offset, uint64_t user_data);
+
+#endif